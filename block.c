@@ -27,6 +27,7 @@
 #include "monitor/monitor.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/throttle-groups.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qjson.h"
 #include "sysemu/sysemu.h"
@@ -54,6 +55,8 @@
 typedef enum {
     BDRV_REQ_COPY_ON_READ = 0x1,
     BDRV_REQ_ZERO_WRITE   = 0x2,
+    BDRV_REQ_MAY_UNMAP    = 0x4,
+    BDRV_REQ_PREFETCH     = 0x8,
 } BdrvRequestFlags;
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
@@ -79,12 +82,15 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
                                                int nb_sectors,
+                                               BdrvRequestFlags flags,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
                                                bool is_write);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors);
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -115,17 +121,11 @@ int is_windows_drive(const char *filename)
 }
 #endif
 
-/* throttling disk I/O limits */
+/* throttling disk I/O limits, shared by all devices in the throttle group */
 void bdrv_set_io_limits(BlockDriverState *bs,
                         ThrottleConfig *cfg)
 {
-    int i;
-
-    throttle_config(&bs->throttle_state, cfg);
-
-    for (i = 0; i < 2; i++) {
-        qemu_co_enter_next(&bs->throttled_reqs[i]);
-    }
+    throttle_group_config(bs, cfg);
 }
 
 /* this function drain all the throttled IOs */
@@ -154,31 +154,36 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
 
     bdrv_start_throttled_reqs(bs);
 
-    throttle_destroy(&bs->throttle_state);
+    throttle_group_unregister_bs(bs);
 }
 
-static void bdrv_throttle_read_timer_cb(void *opaque)
+/* should be called before bdrv_set_io_limits if a limit is set
+ *
+ * @group: the throttle group to join, or NULL for a group of its own
+ */
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[0]);
+    assert(!bs->io_limits_enabled);
+    throttle_group_register_bs(bs, group);
+    bs->io_limits_enabled = true;
 }
 
-static void bdrv_throttle_write_timer_cb(void *opaque)
+/* move a device with I/O limits to another throttle group */
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group)
 {
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[1]);
-}
+    /* this bs is not part of any group */
+    if (!bs->throttle_group) {
+        return;
+    }
 
-/* should be called before bdrv_set_io_limits if a limit is set */
-void bdrv_io_limits_enable(BlockDriverState *bs)
-{
-    assert(!bs->io_limits_enabled);
-    throttle_init(&bs->throttle_state,
-                  QEMU_CLOCK_VIRTUAL,
-                  bdrv_throttle_read_timer_cb,
-                  bdrv_throttle_write_timer_cb,
-                  bs);
-    bs->io_limits_enabled = true;
+    /* this bs is already part of the requested group */
+    if (!strcmp(throttle_group_get_name(bs),
+                group ? group : bdrv_get_device_name(bs))) {
+        return;
+    }
+
+    bdrv_io_limits_disable(bs);
+    bdrv_io_limits_enable(bs, group);
 }
 
 /* This function makes an IO wait if needed
@@ -190,27 +195,9 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
                                      int nb_sectors,
                                      bool is_write)
 {
-    /* does this io must wait */
-    bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
-
-    /* if must wait or any request of this type throttled queue the IO */
-    if (must_wait ||
-        !qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
-        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
-    }
-
-    /* the IO will be executed, do the accounting */
-    throttle_account(&bs->throttle_state,
-                     is_write,
-                     nb_sectors * BDRV_SECTOR_SIZE);
-
-    /* if the next request must wait -> do nothing */
-    if (throttle_schedule_timer(&bs->throttle_state, is_write)) {
-        return;
-    }
-
-    /* else queue next request for execution */
-    qemu_co_queue_next(&bs->throttled_reqs[is_write]);
+    throttle_group_co_io_limits_intercept(bs,
+                                          nb_sectors * BDRV_SECTOR_SIZE,
+                                          is_write);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -1447,11 +1434,18 @@ void bdrv_close(BlockDriverState *bs)
     if (bs->job) {
         block_job_cancel_sync(bs->job);
     }
+    /* Stop copy-on-read readahead after the current request */
+    bs->cor_ra_end = 0;
     bdrv_drain_all(); /* complete I/O */
     bdrv_flush(bs);
     bdrv_drain_all(); /* in case flush left pending I/O */
     notifier_list_notify(&bs->close_notifiers, bs);
 
+    /* Named dirty bitmaps describe this image, store them now */
+    while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        bdrv_release_dirty_bitmap(bs, QLIST_FIRST(&bs->dirty_bitmaps));
+    }
+
     if (bs->drv) {
         if (bs->backing_hd) {
             bdrv_unref(bs->backing_hd);
@@ -1507,6 +1501,9 @@ static bool bdrv_requests_pending(BlockDriverState *bs)
     if (!QLIST_EMPTY(&bs->tracked_requests)) {
         return true;
     }
+    if (bs->cor_ra_running) {
+        return true;
+    }
     if (!qemu_co_queue_empty(&bs->throttled_reqs[0])) {
         return true;
     }
@@ -1551,6 +1548,11 @@ void bdrv_drain_all(void)
     bool busy = true;
     BlockDriverState *bs;
 
+    /* Let copy-on-read readahead finish its current chunk, but no more */
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        bs->cor_ra_end = bs->cor_ra_pos;
+    }
+
     while (busy) {
         /* FIXME: We do not have timer support here, so this is effectively
          * a busy wait.
@@ -1595,13 +1597,14 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->dev                = bs_src->dev;
     bs_dest->buffer_alignment   = bs_src->buffer_alignment;
     bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->cor_readahead      = bs_src->cor_readahead;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
+    bs_dest->detect_zeroes      = bs_src->detect_zeroes;
 
     /* i/o throttled req */
-    memcpy(&bs_dest->throttle_state,
-           &bs_src->throttle_state,
-           sizeof(ThrottleState));
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->round_robin        = bs_src->round_robin;
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
@@ -1616,6 +1619,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     /* dirty bitmap */
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
 
     /* reference count */
     bs_dest->refcnt             = bs_src->refcnt;
@@ -1649,11 +1653,12 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     /* bs_new must be anonymous and shouldn't have anything fancy enabled */
     assert(bs_new->device_name[0] == '\0');
     assert(bs_new->dirty_bitmap == NULL);
+    assert(QLIST_EMPTY(&bs_new->dirty_bitmaps));
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1672,7 +1677,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -2575,7 +2580,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     if (drv->bdrv_co_write_zeroes &&
         buffer_is_zero(bounce_buffer, iov.iov_len)) {
         ret = bdrv_co_do_write_zeroes(bs, cluster_sector_num,
-                                      cluster_nb_sectors);
+                                      cluster_nb_sectors, 0);
     } else {
         /* This does not change the data on the disk, it is not necessary
          * to flush even in cache=writethrough mode.
@@ -2601,6 +2606,93 @@ err:
     return ret;
 }
 
+/* Number of sequential copy-on-read requests before readahead starts */
+#define COR_READAHEAD_MIN_STREAK 2
+
+/* Maximum size of a single readahead request, in sectors */
+#define COR_READAHEAD_CHUNK (1024 * 1024 / BDRV_SECTOR_SIZE)
+
+static void coroutine_fn bdrv_cor_readahead_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    while (bs->cor_ra_pos < bs->cor_ra_end) {
+        int64_t sector_num = bs->cor_ra_pos;
+        int nb_sectors = MIN(bs->cor_ra_end - sector_num, COR_READAHEAD_CHUNK);
+        int pnum;
+
+        ret = bdrv_is_allocated(bs, sector_num, nb_sectors, &pnum);
+        if (ret < 0 || pnum <= 0) {
+            break;
+        }
+        if (ret) {
+            /* Already in the image, nothing to copy */
+            goto next;
+        }
+
+        trace_bdrv_cor_readahead(bs, sector_num, pnum);
+
+        iov.iov_len = pnum * BDRV_SECTOR_SIZE;
+        iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_do_readv(bs, sector_num, pnum, &qiov,
+                               BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
+        qemu_vfree(iov.iov_base);
+        if (ret < 0) {
+            break;
+        }
+
+next:
+        /* Don't move backwards if the guest overtook us or started over */
+        if (bs->cor_ra_pos == sector_num) {
+            bs->cor_ra_pos = sector_num + pnum;
+        }
+    }
+
+    bs->cor_ra_running = false;
+}
+
+/*
+ * Stream detector for copy-on-read: after a few requests that each start
+ * where the previous one ended, keep the next cor_readahead sectors copied
+ * into the image by a background coroutine.  Any other request stops the
+ * readahead until the guest reads sequentially again.
+ */
+static void bdrv_cor_readahead(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors)
+{
+    int64_t end = sector_num + nb_sectors;
+    Coroutine *co;
+
+    if (sector_num != bs->cor_ra_next) {
+        bs->cor_ra_next = end;
+        bs->cor_ra_streak = 0;
+        bs->cor_ra_end = bs->cor_ra_pos;
+        return;
+    }
+
+    bs->cor_ra_next = end;
+    if (bs->cor_ra_streak < COR_READAHEAD_MIN_STREAK) {
+        if (++bs->cor_ra_streak < COR_READAHEAD_MIN_STREAK) {
+            return;
+        }
+        bs->cor_ra_pos = end;
+    } else {
+        bs->cor_ra_pos = MAX(bs->cor_ra_pos, end);
+    }
+    bs->cor_ra_end = MIN(end + bs->cor_readahead, bs->total_sectors);
+
+    if (!bs->cor_ra_running && bs->cor_ra_pos < bs->cor_ra_end) {
+        bs->cor_ra_running = true;
+        co = qemu_coroutine_create(bdrv_cor_readahead_entry);
+        qemu_coroutine_enter(co, bs);
+    }
+}
+
 /*
  * Handle a read request in coroutine context
  */
@@ -2624,6 +2716,11 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
     if (flags & BDRV_REQ_COPY_ON_READ) {
         bs->copy_on_read_in_flight++;
+        /* Look at requests in submission order, which stays sequential
+         * even if the guest keeps several requests in flight */
+        if (bs->cor_readahead && !(flags & BDRV_REQ_PREFETCH)) {
+            bdrv_cor_readahead(bs, sector_num, nb_sectors);
+        }
     }
 
     if (bs->copy_on_read_in_flight) {
@@ -2708,8 +2805,32 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+/*
+ * Returns true if the request can be discarded instead of being zeroed: it
+ * must cover whole clusters, and the driver must guarantee that discarded
+ * clusters read back as zeroes (e.g. not if they'd expose a backing file).
+ */
+static bool bdrv_can_unmap_zeroes(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors)
+{
+    BlockDriverInfo bdi;
+    int cluster_sectors;
+
+    if (!(bs->open_flags & BDRV_O_UNMAP) || !bs->drv->bdrv_co_discard) {
+        return false;
+    }
+    if (bdrv_get_info(bs, &bdi) < 0 || !bdi.unallocated_blocks_are_zero ||
+        bdi.cluster_size < BDRV_SECTOR_SIZE) {
+        return false;
+    }
+
+    cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    return (sector_num % cluster_sectors) == 0 &&
+           (nb_sectors % cluster_sectors) == 0;
+}
+
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
     QEMUIOVector qiov;
@@ -2719,6 +2840,15 @@ static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     /* TODO Emulate only part of misaligned requests instead of letting block
      * drivers return -ENOTSUP and emulate everything */
 
+    /* Freeing the clusters is even cheaper than zeroing them */
+    if ((flags & BDRV_REQ_MAY_UNMAP) &&
+        bdrv_can_unmap_zeroes(bs, sector_num, nb_sectors)) {
+        ret = drv->bdrv_co_discard(bs, sector_num, nb_sectors);
+        if (ret == 0) {
+            return 0;
+        }
+    }
+
     /* First try the efficient write zeroes operation */
     if (drv->bdrv_co_write_zeroes) {
         ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
@@ -2773,10 +2903,20 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
 
+    if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
+        !(flags & BDRV_REQ_ZERO_WRITE) && drv->bdrv_co_write_zeroes &&
+        qemu_iovec_is_zero(qiov)) {
+        trace_bdrv_co_detect_zeroes(bs, sector_num, nb_sectors);
+        flags |= BDRV_REQ_ZERO_WRITE;
+        if (bs->detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP) {
+            flags |= BDRV_REQ_MAY_UNMAP;
+        }
+    }
+
     if (ret < 0) {
         /* Do nothing, write notifier decided to fail this request */
     } else if (flags & BDRV_REQ_ZERO_WRITE) {
-        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
+        ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors, flags);
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
     }
@@ -2785,7 +2925,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         ret = bdrv_co_flush(bs);
     }
 
-    if (bs->dirty_bitmap) {
+    if (bs->dirty_bitmap || !QLIST_EMPTY(&bs->dirty_bitmaps)) {
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
 
@@ -2833,6 +2973,10 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EACCES;
     if (bdrv_in_use(bs))
         return -EBUSY;
+    /* Named dirty bitmaps have a fixed size */
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        return -EBUSY;
+    }
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
@@ -3547,7 +3691,7 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
                                  cb, opaque, false);
 }
 
@@ -3557,10 +3701,20 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
-    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, 0,
                                  cb, opaque, true);
 }
 
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, opaque);
+
+    return bdrv_co_aio_rw_vector(bs, sector_num, NULL, nb_sectors,
+                                 BDRV_REQ_ZERO_WRITE, cb, opaque, true);
+}
+
 
 typedef struct MultiwriteCB {
     int error;
@@ -3828,6 +3982,7 @@ static BlockDriverAIOCB *bdrv_aio_writev_em(BlockDriverState *bs,
 typedef struct BlockDriverAIOCBCoroutine {
     BlockDriverAIOCB common;
     BlockRequest req;
+    BdrvRequestFlags flags;
     bool is_write;
     bool *done;
     QEMUBH* bh;
@@ -3872,10 +4027,10 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov, 0);
+            acb->req.nb_sectors, acb->req.qiov, acb->flags);
     }
 
     acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
@@ -3886,6 +4041,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                int64_t sector_num,
                                                QEMUIOVector *qiov,
                                                int nb_sectors,
+                                               BdrvRequestFlags flags,
                                                BlockDriverCompletionFunc *cb,
                                                void *opaque,
                                                bool is_write)
@@ -3897,6 +4053,7 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
     acb->req.sector = sector_num;
     acb->req.nb_sectors = nb_sectors;
     acb->req.qiov = qiov;
+    acb->flags = flags;
     acb->is_write = is_write;
     acb->done = NULL;
 
@@ -4187,6 +4344,9 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         bdrv_reset_dirty(bs, sector_num, nb_sectors);
     }
 
+    /* The contents change, so incremental backups must copy the range */
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
+
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
         return 0;
@@ -4383,7 +4543,10 @@ void bdrv_dirty_iter_init(BlockDriverState *bs, HBitmapIter *hbi)
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
-    hbitmap_set(bs->dirty_bitmap, cur_sector, nr_sectors);
+    if (bs->dirty_bitmap) {
+        hbitmap_set(bs->dirty_bitmap, cur_sector, nr_sectors);
+    }
+    bdrv_set_dirty_bitmaps(bs, cur_sector, nr_sectors);
 }
 
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
@@ -4401,6 +4564,402 @@ int64_t bdrv_get_dirty_count(BlockDriverState *bs)
     }
 }
 
+/*
+ * Named dirty bitmaps
+ *
+ * In addition to the anonymous bitmap used by mirroring and block migration,
+ * any number of named bitmaps can be attached to a device.  They record all
+ * writes from their creation on and are used for incremental backup.
+ *
+ * A named bitmap can be backed by a file, so that it survives a restart of
+ * QEMU.  The file is loaded when the bitmap is created and written back when
+ * it is released (explicitly or when the image is closed).  While the bitmap
+ * is in use, the file is flagged as such; if QEMU goes away without writing
+ * it back, the next user can't trust its contents and considers the whole
+ * device dirty.
+ */
+
+#define DIRTY_BITMAP_MAGIC      0x5144424d /* "QDBM" */
+#define DIRTY_BITMAP_VERSION    1
+#define DIRTY_BITMAP_IN_USE     (1 << 0)
+
+#define DIRTY_BITMAP_DEFAULT_GRANULARITY    65536
+
+typedef struct QEMU_PACKED DirtyBitmapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          /* in sectors */
+    uint32_t granularity;   /* log2 of the number of sectors per bit */
+    uint32_t flags;
+} DirtyBitmapHeader;
+
+struct BdrvDirtyBitmap {
+    char *name;
+    HBitmap *bitmap;
+    int64_t size;           /* in sectors */
+    bool frozen;            /* contents handed out to a backup job */
+    char *filename;
+    int fd;
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+};
+
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+    }
+}
+
+/* Length in bytes of the bit array of a bitmap file */
+static size_t dirty_bitmap_file_len(int64_t size, int granularity)
+{
+    uint64_t nb_bits = DIV_ROUND_UP(size, (uint64_t)1 << granularity);
+
+    return DIV_ROUND_UP(nb_bits, 8);
+}
+
+static int dirty_bitmap_write_header(BdrvDirtyBitmap *bitmap, uint32_t flags)
+{
+    DirtyBitmapHeader header = {
+        .magic          = cpu_to_be32(DIRTY_BITMAP_MAGIC),
+        .version        = cpu_to_be32(DIRTY_BITMAP_VERSION),
+        .size           = cpu_to_be64(bitmap->size),
+        .granularity    = cpu_to_be32(hbitmap_granularity(bitmap->bitmap)),
+        .flags          = cpu_to_be32(flags),
+    };
+
+    if (pwrite(bitmap->fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -errno;
+    }
+    if (qemu_fdatasync(bitmap->fd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+/* Sets the granule containing @sector in @hb, clamped to the bitmap size */
+static void dirty_bitmap_set_granule(HBitmap *hb, int64_t size,
+                                     int64_t sector)
+{
+    int64_t granule = (int64_t)1 << hbitmap_granularity(hb);
+
+    hbitmap_set(hb, sector, MIN(granule, size - sector));
+}
+
+/*
+ * Writes the bits of @bitmap to its file, then clears the in-use flag.  The
+ * file is not modified by later writes to the device.
+ */
+static int dirty_bitmap_store(BdrvDirtyBitmap *bitmap)
+{
+    int granularity = hbitmap_granularity(bitmap->bitmap);
+    size_t len = dirty_bitmap_file_len(bitmap->size, granularity);
+    uint8_t *buf = g_malloc0(len);
+    HBitmapIter hbi;
+    int64_t sector;
+    int ret;
+
+    hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        uint64_t bit = sector >> granularity;
+        buf[bit / 8] |= 1 << (bit % 8);
+    }
+
+    ret = pwrite(bitmap->fd, buf, len, sizeof(DirtyBitmapHeader));
+    g_free(buf);
+    if (ret != len) {
+        return ret < 0 ? -errno : -EIO;
+    }
+    if (qemu_fdatasync(bitmap->fd) < 0) {
+        return -errno;
+    }
+
+    return dirty_bitmap_write_header(bitmap, 0);
+}
+
+/*
+ * Opens or creates the file of @bitmap and allocates bitmap->bitmap from its
+ * contents.  A new file yields a clean bitmap.  @granularity is in sectors
+ * (log2), or -1 to use the one from the file, if any.
+ */
+static int dirty_bitmap_open_file(BdrvDirtyBitmap *bitmap,
+                                  const char *filename, int granularity,
+                                  Error **errp)
+{
+    DirtyBitmapHeader header;
+    uint8_t *buf = NULL;
+    int fd, ret;
+
+    fd = qemu_open(filename, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not open '%s'", filename);
+        return -errno;
+    }
+
+    ret = pread(fd, &header, sizeof(header), 0);
+    if (ret == 0) {
+        if (granularity < 0) {
+            granularity = ffs(DIRTY_BITMAP_DEFAULT_GRANULARITY >>
+                              BDRV_SECTOR_BITS) - 1;
+        }
+        bitmap->bitmap = hbitmap_alloc(bitmap->size, granularity);
+    } else if (ret == sizeof(header) &&
+               be32_to_cpu(header.magic) == DIRTY_BITMAP_MAGIC &&
+               be32_to_cpu(header.version) == DIRTY_BITMAP_VERSION) {
+        int file_granularity = be32_to_cpu(header.granularity);
+        uint32_t flags = be32_to_cpu(header.flags);
+        size_t len;
+        uint64_t bit;
+
+        if (be64_to_cpu(header.size) != bitmap->size) {
+            error_setg(errp, "Dirty bitmap file '%s' was created for a device "
+                       "of a different size", filename);
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (file_granularity > 30 ||
+            (granularity >= 0 && granularity != file_granularity)) {
+            error_setg(errp, "Dirty bitmap file '%s' has a different "
+                       "granularity", filename);
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        bitmap->bitmap = hbitmap_alloc(bitmap->size, file_granularity);
+        if (flags & DIRTY_BITMAP_IN_USE) {
+            /* It was not stored properly, any sector may have changed */
+            hbitmap_set(bitmap->bitmap, 0, bitmap->size);
+        } else {
+            len = dirty_bitmap_file_len(bitmap->size, file_granularity);
+            buf = g_malloc(len);
+            ret = pread(fd, buf, len, sizeof(header));
+            if (ret != len) {
+                error_setg(errp, "Could not read dirty bitmap file '%s'",
+                           filename);
+                ret = -EIO;
+                goto fail;
+            }
+            for (bit = 0; bit < len * 8; bit++) {
+                int64_t sector = bit << file_granularity;
+                if (sector >= bitmap->size) {
+                    break;
+                }
+                if (buf[bit / 8] & (1 << (bit % 8))) {
+                    dirty_bitmap_set_granule(bitmap->bitmap, bitmap->size,
+                                             sector);
+                }
+            }
+            g_free(buf);
+            buf = NULL;
+        }
+    } else {
+        error_setg(errp, "'%s' is not a dirty bitmap file", filename);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bitmap->fd = fd;
+    ret = dirty_bitmap_write_header(bitmap, DIRTY_BITMAP_IN_USE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write dirty bitmap file '%s'",
+                         filename);
+        goto fail;
+    }
+    bitmap->filename = g_strdup(filename);
+
+    return 0;
+
+fail:
+    g_free(buf);
+    if (bitmap->bitmap) {
+        hbitmap_free(bitmap->bitmap);
+        bitmap->bitmap = NULL;
+    }
+    bitmap->fd = -1;
+    qemu_close(fd);
+    return ret;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Creates the dirty bitmap @name on @bs.  @granularity is in bytes; 0 means
+ * the default, or the granularity of the file if it already exists.  If
+ * @filename is not NULL, the bitmap is loaded from and stored to that file.
+ */
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name, int granularity,
+                                          const char *filename, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t length;
+    int gran = -1;
+
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Dirty bitmap '%s' already exists", name);
+        return NULL;
+    }
+
+    if (granularity) {
+        if (granularity < BDRV_SECTOR_SIZE ||
+            (granularity & (granularity - 1))) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
+                      "a power of 2, at least 512");
+            return NULL;
+        }
+        gran = ffs(granularity >> BDRV_SECTOR_BITS) - 1;
+    }
+
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        error_setg_errno(errp, -length, "Could not get length of '%s'",
+                         bdrv_get_device_name(bs));
+        return NULL;
+    }
+
+    bitmap = g_new0(BdrvDirtyBitmap, 1);
+    bitmap->size = length >> BDRV_SECTOR_BITS;
+    bitmap->fd = -1;
+
+    if (filename) {
+        if (dirty_bitmap_open_file(bitmap, filename, gran, errp) < 0) {
+            g_free(bitmap);
+            return NULL;
+        }
+    } else {
+        if (gran < 0) {
+            gran = ffs(DIRTY_BITMAP_DEFAULT_GRANULARITY >>
+                       BDRV_SECTOR_BITS) - 1;
+        }
+        bitmap->bitmap = hbitmap_alloc(bitmap->size, gran);
+    }
+
+    bitmap->name = g_strdup(name);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+
+    trace_bdrv_create_dirty_bitmap(bs, name, bitmap->size,
+                                   hbitmap_granularity(bitmap->bitmap));
+    return bitmap;
+}
+
+/*
+ * Removes @bitmap from @bs and stores it to its file, if it has one.  The
+ * bitmap must not be frozen.
+ */
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    int ret;
+
+    assert(!bitmap->frozen);
+
+    trace_bdrv_release_dirty_bitmap(bs, bitmap->name,
+                                    hbitmap_count(bitmap->bitmap));
+
+    if (bitmap->fd >= 0) {
+        ret = dirty_bitmap_store(bitmap);
+        if (ret < 0) {
+            error_report("Could not store dirty bitmap '%s' to '%s': %s",
+                         bitmap->name, bitmap->filename, strerror(-ret));
+        }
+        qemu_close(bitmap->fd);
+    }
+
+    QLIST_REMOVE(bitmap, list);
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->filename);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->frozen;
+}
+
+int bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+/*
+ * Hands the current contents of @bitmap over to the caller and lets the
+ * bitmap start again from a clean state.  Until bdrv_dirty_bitmap_thaw() is
+ * called, the bitmap can't be released or frozen again.
+ */
+HBitmap *bdrv_dirty_bitmap_freeze(BdrvDirtyBitmap *bitmap)
+{
+    HBitmap *frozen = bitmap->bitmap;
+
+    assert(!bitmap->frozen);
+    bitmap->bitmap = hbitmap_alloc(bitmap->size,
+                                   hbitmap_granularity(frozen));
+    bitmap->frozen = true;
+    return frozen;
+}
+
+/*
+ * Ends the freeze of @bitmap.  If @merge is true (the user of the frozen
+ * contents failed), the bits of @frozen are added back to the bitmap so that
+ * they are not lost.  @frozen is freed in any case.
+ */
+void bdrv_dirty_bitmap_thaw(BdrvDirtyBitmap *bitmap, HBitmap *frozen,
+                            bool merge)
+{
+    HBitmapIter hbi;
+    int64_t sector;
+
+    assert(bitmap->frozen);
+
+    if (merge) {
+        hbitmap_iter_init(&hbi, frozen, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+            dirty_bitmap_set_granule(bitmap->bitmap, bitmap->size, sector);
+        }
+    }
+
+    hbitmap_free(frozen);
+    bitmap->frozen = false;
+}
+
+BlockDirtyBitmapInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+    BlockDirtyBitmapInfoList *list = NULL;
+    BlockDirtyBitmapInfoList **plist = &list;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        BlockDirtyBitmapInfo *info = g_new0(BlockDirtyBitmapInfo, 1);
+        BlockDirtyBitmapInfoList *entry = g_new0(BlockDirtyBitmapInfoList, 1);
+
+        info->name = g_strdup(bitmap->name);
+        info->count = hbitmap_count(bitmap->bitmap) * BDRV_SECTOR_SIZE;
+        info->granularity = bdrv_dirty_bitmap_granularity(bitmap);
+        info->has_file = bitmap->filename != NULL;
+        info->file = g_strdup(bitmap->filename);
+        info->frozen = bitmap->frozen;
+
+        entry->value = info;
+        *plist = entry;
+        plist = &entry->next;
+    }
+
+    return list;
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -27,6 +27,8 @@
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+#define BACKUP_DEFAULT_WORKERS 1
+
 typedef struct CowRequest {
     int64_t start;
     int64_t end;
@@ -45,8 +47,37 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     HBitmap *bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Named dirty bitmap and its contents at the start of the job */
+    BdrvDirtyBitmap *sync_bitmap;
+    HBitmap *sync_snapshot;
+
+    /* Background copy workers */
+    int max_workers;
+    int nb_workers;
+    bool waiting_for_worker;
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t failed_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+} BackupWorker;
+
+/* Returns true if every cluster in [start, end) was already copied */
+static bool backup_range_copied(BackupBlockJob *job, int64_t start,
+                                int64_t end)
+{
+    for (; start < end; start++) {
+        if (!hbitmap_get(job->bitmap, start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -97,11 +128,21 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     int64_t start, end;
     int n;
 
-    qemu_co_rwlock_rdlock(&job->flush_rwlock);
-
     start = sector_num / BACKUP_SECTORS_PER_CLUSTER;
     end = DIV_ROUND_UP(sector_num + nb_sectors, BACKUP_SECTORS_PER_CLUSTER);
 
+    /* Clusters are only marked in the bitmap once they are safely on the
+     * target, so a fully copied range needs neither the lock nor the
+     * request tracking.  This is the common case for guest writes once the
+     * background copy has gone past them.
+     */
+    if (backup_range_copied(job, start, end)) {
+        trace_backup_do_cow_fast_skip(job, sector_num, nb_sectors);
+        return 0;
+    }
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
     trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
 
     wait_for_overlapping_requests(job, start, end);
@@ -221,6 +262,135 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+static void coroutine_fn backup_worker_co(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    bool error_is_read = false;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs, w->cluster * BACKUP_SECTORS_PER_CLUSTER,
+                        BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
+    if (ret < 0 &&
+        (job->worker_ret == 0 || w->cluster < job->failed_cluster)) {
+        /* Remember the first failed cluster, copying resumes from there */
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->failed_cluster = w->cluster;
+    }
+
+    job->nb_workers--;
+    g_free(w);
+
+    if (job->waiting_for_worker) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+static void coroutine_fn backup_wait_for_worker(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_worker);
+    job->waiting_for_worker = true;
+    qemu_coroutine_yield();
+    job->waiting_for_worker = false;
+}
+
+static void coroutine_fn backup_drain_workers(BackupBlockJob *job)
+{
+    while (job->nb_workers > 0) {
+        backup_wait_for_worker(job);
+    }
+}
+
+static void coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t cluster)
+{
+    BackupWorker *w;
+    Coroutine *co;
+
+    while (job->nb_workers >= job->max_workers) {
+        backup_wait_for_worker(job);
+    }
+
+    w = g_new(BackupWorker, 1);
+    w->job = job;
+    w->cluster = cluster;
+    job->nb_workers++;
+
+    co = qemu_coroutine_create(backup_worker_co);
+    qemu_coroutine_enter(co, w);
+}
+
+/*
+ * Apply the error action for a failed background copy.  Returns the error
+ * if the job must fail, otherwise 0 with *start rewound to the first failed
+ * cluster so that it is retried (clusters copied in the meantime are
+ * skipped by backup_do_cow).
+ */
+static int backup_handle_worker_error(BackupBlockJob *job, int64_t *start)
+{
+    BlockErrorAction action;
+    int ret = job->worker_ret;
+
+    job->worker_ret = 0;
+    action = backup_error_action(job, job->worker_error_is_read, -ret);
+    if (action == BDRV_ACTION_REPORT) {
+        return ret;
+    }
+    *start = job->failed_cluster;
+    return 0;
+}
+
+/*
+ * For incremental backup, the clusters that are clean in the snapshot of the
+ * dirty bitmap are marked as copied from the start.  Both the background copy
+ * and backup_do_cow() then leave them alone.
+ */
+static void backup_init_incremental(BackupBlockJob *job, int64_t end)
+{
+    int64_t granule = (int64_t)1 << hbitmap_granularity(job->sync_snapshot);
+    int64_t total_sectors = job->common.len / BDRV_SECTOR_SIZE;
+    HBitmapIter hbi;
+    int64_t sector, clean;
+
+    hbitmap_set(job->bitmap, 0, end);
+
+    hbitmap_iter_init(&hbi, job->sync_snapshot, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        int64_t first = sector / BACKUP_SECTORS_PER_CLUSTER;
+        int64_t last = DIV_ROUND_UP(MIN(sector + granule, total_sectors),
+                                    BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_reset(job->bitmap, first, last - first);
+    }
+
+    /* Clean clusters count as done for the progress report */
+    clean = hbitmap_count(job->bitmap);
+    job->common.offset = MIN(clean * BACKUP_CLUSTER_SIZE, job->common.len);
+
+    trace_backup_init_incremental(job, end - clean);
+}
+
+/* Returns the first cluster from @start on that is dirty in the snapshot */
+static int64_t backup_next_dirty_cluster(BackupBlockJob *job, int64_t start,
+                                         int64_t end)
+{
+    int64_t total_sectors = job->common.len / BDRV_SECTOR_SIZE;
+    HBitmapIter hbi;
+    int64_t sector;
+
+    if (start * BACKUP_SECTORS_PER_CLUSTER >= total_sectors) {
+        return end;
+    }
+
+    hbitmap_iter_init(&hbi, job->sync_snapshot,
+                      start * BACKUP_SECTORS_PER_CLUSTER);
+    sector = hbitmap_iter_next(&hbi);
+    if (sector < 0) {
+        return end;
+    }
+    return MAX(start, sector / BACKUP_SECTORS_PER_CLUSTER);
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -241,6 +411,9 @@ static void coroutine_fn backup_run(void *opaque)
                        BACKUP_SECTORS_PER_CLUSTER);
 
     job->bitmap = hbitmap_alloc(end, 0);
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        backup_init_incremental(job, end);
+    }
 
     bdrv_set_enable_write_cache(target, true);
     bdrv_set_on_error(target, on_target_error, on_target_error);
@@ -257,74 +430,94 @@ static void coroutine_fn backup_run(void *opaque)
             job->common.busy = true;
         }
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
+        /* FULL, TOP and INCREMENTAL SYNC_MODE's require copying.. */
+        for (;;) {
+            for (; start < end; start++) {
+                if (block_job_is_cancelled(&job->common)) {
+                    break;
+                }
 
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
+                if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+                    start = backup_next_dirty_cluster(job, start, end);
+                    if (start >= end) {
+                        break;
+                    }
+                }
 
-            /* we need to yield so that qemu_aio_flush() returns.
-             * (without, VM does not reboot)
-             */
-            if (job->common.speed) {
-                uint64_t delay_ns = ratelimit_calculate_delay(
-                        &job->limit, job->sectors_read);
-                job->sectors_read = 0;
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-            } else {
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-            }
+                /* we need to yield so that qemu_aio_flush() returns.
+                 * (without, VM does not reboot)
+                 */
+                if (job->common.speed) {
+                    uint64_t delay_ns = ratelimit_calculate_delay(
+                            &job->limit, job->sectors_read);
+                    job->sectors_read = 0;
+                    block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME,
+                                       delay_ns);
+                } else {
+                    block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+                }
 
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
+                if (block_job_is_cancelled(&job->common)) {
+                    break;
+                }
 
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1) {
+                if (job->worker_ret < 0) {
+                    ret = backup_handle_worker_error(job, &start);
+                    if (ret < 0) {
                         break;
                     }
                 }
 
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
+                if (hbitmap_get(job->bitmap, start)) {
+                    continue; /* already copied by a guest write */
+                }
+
+                if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+                    int i, n;
+                    int alloced = 0;
+
+                    /* Check to see if these blocks are already in the
+                     * backing file. */
+
+                    for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
+                        /* bdrv_is_allocated() only returns true/false based
+                         * on the first set of sectors it comes across that
+                         * are are all in the same state.
+                         * For that reason we must verify each sector in the
+                         * backup cluster length.  We end up copying more than
+                         * needed but at some point that is always the case. */
+                        alloced =
+                            bdrv_is_allocated(bs,
+                                    start * BACKUP_SECTORS_PER_CLUSTER + i,
+                                    BACKUP_SECTORS_PER_CLUSTER - i, &n);
+                        i += n;
+
+                        if (alloced == 1) {
+                            break;
+                        }
+                    }
+
+                    /* If the above loop never found any sectors that are in
+                     * the topmost image, skip this backup. */
+                    if (alloced == 0) {
+                        continue;
+                    }
                 }
+                /* FULL sync mode we copy the whole drive. */
+                backup_start_worker(job, start);
             }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
+
+            /* Let the workers finish, then retry failed clusters if the
+             * error action allows it.
+             */
+            backup_drain_workers(job);
+            if (ret < 0 || job->worker_ret == 0 ||
+                block_job_is_cancelled(&job->common)) {
+                break;
+            }
+            ret = backup_handle_worker_error(job, &start);
             if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BDRV_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
+                break;
             }
         }
     }
@@ -337,6 +530,14 @@ static void coroutine_fn backup_run(void *opaque)
 
     hbitmap_free(job->bitmap);
 
+    if (job->sync_bitmap) {
+        /* Unless the backup succeeded, the next one must copy the sectors
+         * of this one again */
+        bdrv_dirty_bitmap_thaw(job->sync_bitmap, job->sync_snapshot,
+                               ret < 0 ||
+                               block_job_is_cancelled(&job->common));
+    }
+
     bdrv_iostatus_disable(target);
     bdrv_unref(target);
 
@@ -344,7 +545,8 @@ static void coroutine_fn backup_run(void *opaque)
 }
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, MirrorSyncMode sync_mode,
+                  int64_t speed, MirrorSyncMode sync_mode, int workers,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -355,6 +557,12 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     assert(bs);
     assert(target);
     assert(cb);
+    assert(sync_mode != MIRROR_SYNC_MODE_INCREMENTAL || sync_bitmap);
+
+    if (sync_bitmap && bdrv_dirty_bitmap_frozen(sync_bitmap)) {
+        error_setg(errp, "Dirty bitmap is in use by another backup job");
+        return;
+    }
 
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
@@ -380,6 +588,13 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->max_workers = workers ? workers : BACKUP_DEFAULT_WORKERS;
+    if (sync_bitmap) {
+        /* The backup covers everything written up to now, later writes go
+         * to the next increment */
+        job->sync_bitmap = sync_bitmap;
+        job->sync_snapshot = bdrv_dirty_bitmap_freeze(sync_bitmap);
+    }
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -39,6 +40,30 @@ struct qemu_laiocb {
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
+
+    /* reap completions from the mmap'd ring instead of io_getevents() */
+    bool use_ring;
+};
+
+/*
+ * Completion ring layout shared with the kernel (fs/aio.c).  The io_context_t
+ * returned by io_setup() is the user address of this mmap'd ring, so
+ * completed events can be consumed without entering the kernel.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;                /* number of io_events */
+    unsigned head;              /* written by userspace */
+    unsigned tail;              /* written by the kernel */
+
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;     /* size of aio_ring */
+
+    struct io_event io_events[0];
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -74,26 +99,93 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+static bool qemu_laio_ring_usable(struct qemu_laio_state *s)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    return ring->magic == AIO_RING_MAGIC && ring->incompat_features == 0 &&
+           ring->header_length == sizeof(*ring);
+}
+
+/*
+ * Copy up to @max completed events out of the kernel's completion ring and
+ * advance the ring head.  Returns the number of events reaped, which may be
+ * 0 if the ring is empty, or -EIO if the ring header is inconsistent.
+ */
+static int qemu_laio_reap_ring(struct qemu_laio_state *s,
+                               struct io_event *events, int max)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+    unsigned head, tail, nr;
+    int n = 0;
+
+    nr = ring->nr;
+    head = atomic_read(&ring->head);
+    tail = atomic_read(&ring->tail);
+    /* Read the tail before the events it publishes */
+    smp_rmb();
+
+    if (head >= nr || tail >= nr) {
+        /* Inconsistent ring, let io_getevents() sort it out */
+        return -EIO;
+    }
+
+    while (head != tail && n < max) {
+        events[n++] = ring->io_events[head];
+        head = (head + 1) % nr;
+    }
+
+    if (n) {
+        /* Finish copying the events before handing the slots back */
+        smp_mb();
+        atomic_set(&ring->head, head);
+    }
+    return n;
+}
+
+static int qemu_laio_get_events(struct qemu_laio_state *s,
+                                struct io_event *events, int max)
+{
+    struct timespec ts = { 0 };
+    int nevents;
+
+    if (s->use_ring) {
+        nevents = qemu_laio_reap_ring(s, events, max);
+        if (nevents >= 0) {
+            return nevents;
+        }
+        /* The ring looks corrupted, stop trusting it */
+        s->use_ring = false;
+    }
+
+    do {
+        nevents = io_getevents(s->ctx, 0, max, events, &ts);
+    } while (nevents == -EINTR);
+
+    return nevents;
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
     while (event_notifier_test_and_clear(&s->e)) {
         struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
         int nevents, i;
 
-        do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
-
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+        /* The eventfd counter may cover more completions than one batch */
+        while ((nevents = qemu_laio_get_events(s, events, MAX_EVENTS)) > 0) {
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+            if (nevents < MAX_EVENTS) {
+                break;
+            }
         }
     }
 }
@@ -189,6 +281,7 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0) {
         goto out_close_efd;
     }
+    s->use_ring = qemu_laio_ring_usable(s);
 
     qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb);
 
@@ -20,6 +20,12 @@
 #define SLICE_TIME    100000000ULL /* ns */
 #define MAX_IN_FLIGHT 16
 
+/* Thresholds, in requests queued in the I/O path, used to adapt the
+ * number of requests in flight (see mirror_update_in_flight_limit).
+ */
+#define MIRROR_QUEUE_LOW  1
+#define MIRROR_QUEUE_HIGH 3
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -47,6 +53,16 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     int in_flight;
     int ret;
+    bool waiting_for_io;
+
+    /* Adaptive concurrency: at most in_flight_limit requests are issued,
+     * and in_flight_limit varies between 1 and max_in_flight.
+     */
+    int max_in_flight;
+    int in_flight_limit;
+    int64_t min_latency_ns;
+    int64_t round_latency_ns;
+    int round_ops;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -54,6 +70,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -69,6 +86,47 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+/*
+ * Adapt the number of requests in flight to the latency of completed
+ * requests, similar to TCP Vegas.  Latency is normalised to one chunk so
+ * that merged requests of different size can be compared.  Once per round
+ * of in_flight_limit completions, estimate how many requests are just
+ * sitting in queues: if the average latency is close to the best one seen,
+ * adding requests still adds throughput; if it grew a lot, the device is
+ * saturated and requests only wait longer.
+ */
+static void mirror_update_in_flight_limit(MirrorBlockJob *s, MirrorOp *op)
+{
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int nb_chunks = DIV_ROUND_UP(op->nb_sectors, sectors_per_chunk);
+    int64_t latency_ns, avg_ns, queued;
+
+    latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns;
+    s->round_latency_ns += latency_ns / nb_chunks;
+    if (++s->round_ops < s->in_flight_limit) {
+        return;
+    }
+
+    avg_ns = MAX(s->round_latency_ns / s->round_ops, 1);
+    s->round_latency_ns = 0;
+    s->round_ops = 0;
+    if (s->min_latency_ns == 0 || avg_ns < s->min_latency_ns) {
+        s->min_latency_ns = avg_ns;
+    }
+
+    queued = s->in_flight_limit -
+             s->in_flight_limit * s->min_latency_ns / avg_ns;
+    if (queued < MIRROR_QUEUE_LOW && s->in_flight_limit < s->max_in_flight) {
+        s->in_flight_limit++;
+    } else if (queued > MIRROR_QUEUE_HIGH && s->in_flight_limit > 1) {
+        s->in_flight_limit--;
+        /* Let the baseline follow slow changes of the device latency */
+        s->min_latency_ns += s->min_latency_ns / 8;
+    }
+    trace_mirror_in_flight_limit(s, avg_ns, s->min_latency_ns,
+                                 s->in_flight_limit);
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -93,9 +151,19 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     if (s->cow_bitmap && ret >= 0) {
         bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
     }
+    if (ret >= 0) {
+        mirror_update_in_flight_limit(s, op);
+    }
 
+    qemu_iovec_destroy(&op->qiov);
     g_slice_free(MirrorOp, op);
-    qemu_coroutine_enter(s->common.co, NULL);
+
+    /* The job coroutine may also be waiting inside the block layer, only
+     * wake it up if it is waiting for us.
+     */
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
 }
 
 static void mirror_write_complete(void *opaque, int ret)
@@ -136,11 +204,21 @@ static void mirror_read_complete(void *opaque, int ret)
                     mirror_write_complete, op);
 }
 
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
 static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
-    int nb_sectors, sectors_per_chunk, nb_chunks;
+    int nb_sectors, sectors_per_chunk, nb_chunks, pnum;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
+    int64_t status;
+    bool is_zero;
     MirrorOp *op;
 
     s->sector_num = hbitmap_iter_next(&s->hbi);
@@ -177,7 +255,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
     while (test_bit(next_chunk, s->in_flight_bitmap)) {
         trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 
     do {
@@ -213,7 +291,7 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -229,6 +307,13 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         next_chunk += added_chunks;
     } while (next_sector < end);
 
+    /* Ranges that read as zeroes are not copied, the target is asked to
+     * write zeroes instead.  The chunks are already marked in flight, so
+     * nothing else touches them while the block status is looked up.
+     */
+    status = bdrv_get_block_status(source, sector_num, nb_sectors, &pnum);
+    is_zero = status >= 0 && (status & BDRV_BLOCK_ZERO) && pnum == nb_sectors;
+
     /* Allocate a MirrorOp that is used as an AIO callback.  */
     op = g_slice_new(MirrorOp);
     op->s = s;
@@ -238,13 +323,15 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
      */
-    qemu_iovec_init(&op->qiov, nb_chunks);
+    qemu_iovec_init(&op->qiov, is_zero ? 1 : nb_chunks);
     next_sector = sector_num;
     while (nb_chunks-- > 0) {
-        MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
-        QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
-        s->buf_free_count--;
-        qemu_iovec_add(&op->qiov, buf, s->granularity);
+        if (!is_zero) {
+            MirrorBuffer *buf = QSIMPLEQ_FIRST(&s->buf_free);
+            QSIMPLEQ_REMOVE_HEAD(&s->buf_free, next);
+            s->buf_free_count--;
+            qemu_iovec_add(&op->qiov, buf, s->granularity);
+        }
 
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
@@ -260,6 +347,14 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     /* Copy the dirty cluster.  */
     s->in_flight++;
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (is_zero) {
+        trace_mirror_one_iteration_zero(s, sector_num, nb_sectors);
+        bdrv_aio_write_zeroes(s->target, sector_num, nb_sectors,
+                              mirror_write_complete, op);
+        return;
+    }
+
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
@@ -285,7 +380,7 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -376,10 +471,10 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->in_flight_limit || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
                 mirror_iteration(s);
@@ -535,6 +630,7 @@ static const BlockJobDriver mirror_job_driver = {
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
+                  int max_in_flight,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
@@ -556,6 +652,11 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
 
     assert ((granularity & (granularity - 1)) == 0);
 
+    if (max_in_flight == 0) {
+        max_in_flight = MAX_IN_FLIGHT;
+    }
+    assert(max_in_flight > 0);
+
     if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
          on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
         !bdrv_iostatus_is_enabled(bs)) {
@@ -574,6 +675,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->mode = mode;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = max_in_flight;
+    s->in_flight_limit = MIN(max_in_flight, MAX_IN_FLIGHT);
 
     bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
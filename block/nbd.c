@@ -50,14 +50,16 @@
 #endif
 
 #define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_CONNECTIONS	16
+#define HANDLE_TO_INDEX(c, handle) ((handle) ^ ((uint64_t)(intptr_t)c))
+#define INDEX_TO_HANDLE(c, index)  ((index)  ^ ((uint64_t)(intptr_t)c))
 
-typedef struct BDRVNBDState {
+typedef struct BDRVNBDState BDRVNBDState;
+
+/* One socket to the server, with its own set of requests in flight */
+typedef struct NBDConnection {
+    BDRVNBDState *s;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -66,12 +68,22 @@ typedef struct BDRVNBDState {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NBDConnection;
+
+struct BDRVNBDState {
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+
+    NBDConnection *conns;
+    int num_conns;
+    int next_conn;
 
     bool is_unix;
     QemuOpts *socket_opts;
 
     char *export_name; /* An NBD server may export several devices */
-} BDRVNBDState;
+};
 
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
@@ -79,6 +91,7 @@ static int nbd_parse_uri(const char *filename, QDict *options)
     const char *p;
     QueryParams *qp = NULL;
     int ret = 0;
+    int i;
     bool is_unix;
 
     uri = uri_parse(filename);
@@ -105,21 +118,27 @@ static int nbd_parse_uri(const char *filename, QDict *options)
     }
 
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (is_unix && !qp->n) || (!is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        if (!strcmp(qp->p[i].name, "connections")) {
+            qdict_put(options, "connections",
+                      qstring_from_str(qp->p[i].value));
+        } else if (is_unix && !strcmp(qp->p[i].name, "socket")) {
+            qdict_put(options, "path", qstring_from_str(qp->p[i].value));
+        } else {
+            ret = -EINVAL;
+            goto out;
+        }
     }
 
     if (is_unix) {
-        /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        /* nbd+unix:///export?socket=path[&connections=N] */
+        if (uri->server || uri->port || !qdict_haskey(options, "path")) {
             ret = -EINVAL;
             goto out;
         }
-        qdict_put(options, "path", qstring_from_str(qp->p[0].value));
     } else {
         QString *host;
-        /* nbd[+tcp]://host[:port]/export */
+        /* nbd[+tcp]://host[:port]/export[?connections=N] */
         if (!uri->server) {
             ret = -EINVAL;
             goto out;
@@ -220,6 +239,7 @@ out:
 static int nbd_config(BDRVNBDState *s, QDict *options)
 {
     Error *local_err = NULL;
+    const char *conns;
 
     if (qdict_haskey(options, "path")) {
         if (qdict_haskey(options, "host")) {
@@ -252,50 +272,81 @@ static int nbd_config(BDRVNBDState *s, QDict *options)
         qdict_del(options, "export");
     }
 
+    s->num_conns = 1;
+    conns = qdict_get_try_str(options, "connections");
+    if (conns) {
+        char *end;
+
+        s->num_conns = strtol(conns, &end, 10);
+        if (*end || s->num_conns < 1 || s->num_conns > MAX_NBD_CONNECTIONS) {
+            qerror_report(ERROR_CLASS_GENERIC_ERROR, "connections must be "
+                          "between 1 and %d", MAX_NBD_CONNECTIONS);
+            return -EINVAL;
+        }
+        qdict_del(options, "connections");
+    }
+
     return 0;
 }
 
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+/* Pick the connection with the fewest requests in flight, going round
+ * robin among equally loaded ones so that idle sockets all get used.  */
+static NBDConnection *nbd_pick_connection(BDRVNBDState *s)
+{
+    NBDConnection *best = NULL;
+    int i, n;
+
+    for (i = 0; i < s->num_conns; i++) {
+        n = (s->next_conn + i) % s->num_conns;
+        if (!best || s->conns[n].in_flight < best->in_flight) {
+            best = &s->conns[n];
+        }
+    }
+    s->next_conn = (best - s->conns + 1) % s->num_conns;
+    return best;
+}
+
+static void nbd_coroutine_start(NBDConnection *c, struct nbd_request *request)
 {
     int i;
 
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (c->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&c->free_sema);
+        assert(c->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    c->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (c->recv_coroutine[i] == NULL) {
+            c->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(c, i);
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *c = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (c->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(c->sock, &c->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            c->reply.handle = 0;
             goto fail;
         }
     }
@@ -303,63 +354,63 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(c, c->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (c->recv_coroutine[i]) {
+        qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        if (c->recv_coroutine[i]) {
+            qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *c = opaque;
+    qemu_coroutine_enter(c->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *c, struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write, s);
+    qemu_co_mutex_lock(&c->send_mutex);
+    c->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(c->sock, nbd_reply_ready, nbd_restart_write, c);
     if (qiov) {
-        if (!s->is_unix) {
-            socket_set_cork(s->sock, 1);
+        if (!c->s->is_unix) {
+            socket_set_cork(c->sock, 1);
         }
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(c->sock, request);
         if (rc >= 0) {
-            ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_sendv(c->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
-        if (!s->is_unix) {
-            socket_set_cork(s->sock, 0);
+        if (!c->s->is_unix) {
+            socket_set_cork(c->sock, 0);
         }
     } else {
-        rc = nbd_send_request(s->sock, request);
+        rc = nbd_send_request(c->sock, request);
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_aio_set_fd_handler(c->sock, nbd_reply_ready, NULL, c);
+    c->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+static void nbd_co_receive_reply(NBDConnection *c, struct nbd_request *request,
                                  struct nbd_reply *reply,
                                  QEMUIOVector *qiov, int offset)
 {
@@ -368,12 +419,12 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
     /* Wait until we're woken up by the read handler.  TODO: perhaps
      * peek at the next reply and avoid yielding if it's ours?  */
     qemu_coroutine_yield();
-    *reply = s->reply;
+    *reply = c->reply;
     if (reply->handle != request->handle) {
         reply->error = EIO;
     } else {
         if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+            ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov,
                                 offset, request->len);
             if (ret != request->len) {
                 reply->error = EIO;
@@ -381,24 +432,42 @@ static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        c->reply.handle = 0;
     }
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *c, struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(c, request->handle);
+    c->recv_coroutine[i] = NULL;
+    if (c->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&c->free_sema);
     }
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+/* Send a request without payload on @c and wait for its reply */
+static int nbd_co_request(NBDConnection *c, struct nbd_request *request)
+{
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    nbd_coroutine_start(c, request);
+    ret = nbd_co_send_request(c, request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(c, request, &reply, NULL, 0);
+    }
+    nbd_coroutine_end(c, request);
+    return -reply.error;
+}
+
+static int nbd_establish_connection(BlockDriverState *bs, NBDConnection *c)
 {
     BDRVNBDState *s = bs->opaque;
     int sock;
     int ret;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
 
@@ -418,7 +487,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
+    ret = nbd_receive_negotiate(sock, s->export_name, &nbdflags, &size,
                                 &blocksize);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
@@ -426,12 +495,22 @@ static int nbd_establish_connection(BlockDriverState *bs)
         return ret;
     }
 
+    /* All connections must talk to the same export */
+    if (c != &s->conns[0] &&
+        (nbdflags != s->nbdflags || size != s->size)) {
+        logout("NBD server reported a different export on connection %d\n",
+               (int)(c - s->conns));
+        closesocket(sock);
+        return -EINVAL;
+    }
+
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qemu_set_nonblock(sock);
-    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL, s);
+    qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL, c);
 
-    s->sock = sock;
+    c->sock = sock;
+    s->nbdflags = nbdflags;
     s->size = size;
     s->blocksize = blocksize;
 
@@ -439,18 +518,22 @@ static int nbd_establish_connection(BlockDriverState *bs)
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NBDConnection *c)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
+    if (c->sock < 0) {
+        return;
+    }
+
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(c->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(c->sock, NULL, NULL, NULL);
+    closesocket(c->sock);
+    c->sock = -1;
 }
 
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
@@ -458,9 +541,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 {
     BDRVNBDState *s = bs->opaque;
     int result;
-
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    int i;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, options);
@@ -468,12 +549,30 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return result;
     }
 
-    /* establish TCP connection, return error if it fails
+    s->conns = g_new0(NBDConnection, s->num_conns);
+    for (i = 0; i < s->num_conns; i++) {
+        s->conns[i].s = s;
+        s->conns[i].sock = -1;
+        qemu_co_mutex_init(&s->conns[i].send_mutex);
+        qemu_co_mutex_init(&s->conns[i].free_sema);
+    }
+
+    /* establish TCP connections, return error if any fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    result = nbd_establish_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        result = nbd_establish_connection(bs, &s->conns[i]);
+        if (result < 0) {
+            while (--i >= 0) {
+                nbd_teardown_connection(&s->conns[i]);
+            }
+            g_free(s->conns);
+            s->conns = NULL;
+            return result;
+        }
+    }
 
-    return result;
+    return 0;
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
@@ -481,6 +580,7 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *c = nbd_pick_connection(s);
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -489,14 +589,14 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    nbd_coroutine_start(c, &request);
+    ret = nbd_co_send_request(c, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(c, &request, &reply, qiov, offset);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(c, &request);
     return -reply.error;
 
 }
@@ -506,6 +606,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *c = nbd_pick_connection(s);
     struct nbd_request request;
     struct nbd_reply reply;
     ssize_t ret;
@@ -518,14 +619,14 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
+    nbd_coroutine_start(c, &request);
+    ret = nbd_co_send_request(c, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(c, &request, &reply, NULL, 0);
     }
-    nbd_coroutine_end(s, &request);
+    nbd_coroutine_end(c, &request);
     return -reply.error;
 }
 
@@ -567,34 +668,78 @@ static int nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
     return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
 }
 
+typedef struct NBDFlushData {
+    NBDConnection *c;
+    Coroutine *co;
+    int *remaining;
+    int *ret;
+} NBDFlushData;
+
+static void nbd_flush_request(NBDConnection *c, struct nbd_request *request)
+{
+    request->type = NBD_CMD_FLUSH;
+    if (c->s->nbdflags & NBD_FLAG_SEND_FUA) {
+        request->type |= NBD_CMD_FLAG_FUA;
+    }
+
+    request->from = 0;
+    request->len = 0;
+}
+
+static void coroutine_fn nbd_flush_one_entry(void *opaque)
+{
+    NBDFlushData *data = opaque;
+    struct nbd_request request;
+    int ret;
+
+    nbd_flush_request(data->c, &request);
+    ret = nbd_co_request(data->c, &request);
+    if (ret < 0 && *data->ret == 0) {
+        *data->ret = ret;
+    }
+    if (--*data->remaining == 0) {
+        qemu_coroutine_enter(data->co, NULL);
+    }
+}
+
 static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDFlushData *data;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
+    int remaining, ret;
+    int i;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
-    request.type = NBD_CMD_FLUSH;
-    if (s->nbdflags & NBD_FLAG_SEND_FUA) {
-        request.type |= NBD_CMD_FLAG_FUA;
+    if (s->num_conns == 1) {
+        nbd_flush_request(&s->conns[0], &request);
+        return nbd_co_request(&s->conns[0], &request);
     }
 
-    request.from = 0;
-    request.len = 0;
-
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    /* A flush only covers the writes that the server completed on the same
+     * connection, so send one down every socket and wait for all of them.
+     * The block layer only flushes after the writes it cares about have
+     * completed, so no write can slip in between.
+     */
+    data = g_new(NBDFlushData, s->num_conns);
+    remaining = s->num_conns + 1;
+    ret = 0;
+    for (i = 0; i < s->num_conns; i++) {
+        data[i].c = &s->conns[i];
+        data[i].co = qemu_coroutine_self();
+        data[i].remaining = &remaining;
+        data[i].ret = &ret;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_flush_one_entry),
+                             &data[i]);
+    }
+    if (--remaining > 0) {
+        qemu_coroutine_yield();
+    }
+    g_free(data);
+    return ret;
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -602,8 +747,6 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
@@ -612,24 +755,21 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(nbd_pick_connection(s), &request);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
+
     g_free(s->export_name);
     qemu_opts_del(s->socket_opts);
 
-    nbd_teardown_connection(bs);
+    for (i = 0; i < s->num_conns; i++) {
+        nbd_teardown_connection(&s->conns[i]);
+    }
+    g_free(s->conns);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
@@ -24,6 +24,7 @@
 
 #include "block/qapi.h"
 #include "block/block_int.h"
+#include "block/throttle-groups.h"
 #include "qmp-commands.h"
 #include "qapi-visit.h"
 #include "qapi/qmp-output-visitor.h"
@@ -212,6 +213,11 @@ void bdrv_query_info(BlockDriverState *bs,
          ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bs->dirty_bitmap));
     }
 
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        info->has_dirty_bitmaps = true;
+        info->dirty_bitmaps = bdrv_query_dirty_bitmaps(bs);
+    }
+
     if (bs->drv) {
         info->has_inserted = true;
         info->inserted = g_malloc0(sizeof(*info->inserted));
@@ -227,10 +233,11 @@ void bdrv_query_info(BlockDriverState *bs,
         }
 
         info->inserted->backing_file_depth = bdrv_get_backing_file_depth(bs);
+        info->inserted->detect_zeroes = bs->detect_zeroes;
 
         if (bs->io_limits_enabled) {
             ThrottleConfig cfg;
-            throttle_get_config(&bs->throttle_state, &cfg);
+            throttle_group_get_config(bs, &cfg);
             info->inserted->bps     = cfg.buckets[THROTTLE_BPS_TOTAL].avg;
             info->inserted->bps_rd  = cfg.buckets[THROTTLE_BPS_READ].avg;
             info->inserted->bps_wr  = cfg.buckets[THROTTLE_BPS_WRITE].avg;
@@ -267,6 +274,9 @@ void bdrv_query_info(BlockDriverState *bs,
 
             info->inserted->has_iops_size = cfg.op_size;
             info->inserted->iops_size = cfg.op_size;
+
+            info->inserted->has_group = true;
+            info->inserted->group = g_strdup(throttle_group_get_name(bs));
         }
 
         bs0 = bs;
@@ -200,7 +200,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -223,7 +223,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->l2_size * l2_entry_size(s));
     } else {
         uint64_t* old_table;
 
@@ -273,7 +273,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -286,12 +286,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW2_CLUSTER_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_table, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -300,8 +300,8 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) != QCOW2_CLUSTER_COMPRESSED);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + ((uint64_t) i << s->cluster_bits) != l2_entry) {
             break;
         }
     }
@@ -309,12 +309,14 @@ static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        int type = qcow2_get_cluster_type(l2_entry);
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -414,6 +416,60 @@ out:
 }
 
 
+/*
+ * Looks up the subcluster that contains the guest offset @offset in an image
+ * with extended L2 entries and counts how many of the following subclusters
+ * (up to @nb_needed sectors, counted from the start of the cluster) have the
+ * same type and, for allocated subclusters, are contiguous in the image file.
+ * The subclusters may span several clusters of the same L2 table.
+ *
+ * Returns the subcluster type, sets *cluster_offset to the host offset of the
+ * cluster (0 unless the subclusters are allocated or compressed) and
+ * *nb_available to the number of sectors from the cluster start.
+ */
+static int get_subcluster_range(BDRVQcowState *s, uint64_t *l2_table,
+                                int l2_index, uint64_t offset,
+                                uint64_t nb_needed, uint64_t *cluster_offset,
+                                uint64_t *nb_available)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t host_offset = l2_entry & L2E_OFFSET_MASK;
+    int nb_sc = DIV_ROUND_UP(nb_needed, s->subcluster_sectors);
+    int type, i;
+
+    i = offset_to_sc_index(s, offset);
+    type = qcow2_get_subcluster_type(l2_entry, l2_bitmap, i);
+
+    if (type == QCOW2_CLUSTER_COMPRESSED) {
+        /* Compressed clusters can only be processed one by one */
+        *cluster_offset = l2_entry & L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        *nb_available = s->cluster_sectors;
+        return type;
+    }
+
+    for (i++; i < nb_sc; i++) {
+        int c = i / QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+        int sc = i % QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+
+        l2_entry = get_l2_entry(s, l2_table, l2_index + c);
+        l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + c);
+
+        if (qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc) != type) {
+            break;
+        }
+        if (type == QCOW2_CLUSTER_NORMAL &&
+            (l2_entry & L2E_OFFSET_MASK) !=
+            host_offset + ((uint64_t) c << s->cluster_bits)) {
+            break;
+        }
+    }
+
+    *cluster_offset = (type == QCOW2_CLUSTER_NORMAL) ? host_offset : 0;
+    *nb_available = (uint64_t) i * s->subcluster_sectors;
+    return type;
+}
+
 /*
  * get_cluster_offset
  *
@@ -484,7 +540,15 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+
+    if (s->extended_l2) {
+        ret = get_subcluster_range(s, l2_table, l2_index, offset, nb_needed,
+                                   cluster_offset, &nb_available);
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        goto out;
+    }
+
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
@@ -498,19 +562,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         if (s->qcow_version < 3) {
             return -EIO;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table, l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
     default:
@@ -581,7 +645,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
     }
@@ -626,7 +690,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -650,7 +714,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (s->extended_l2) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -688,6 +755,27 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Returns the subcluster allocation bits that must be set for cluster @i of
+ * the allocation @m, i.e. the subclusters covered by the guest write and its
+ * COW regions.
+ */
+static uint64_t subcluster_alloc_bits(BDRVQcowState *s, QCowL2Meta *m, int i)
+{
+    int64_t cluster_start = (int64_t) i << s->cluster_bits;
+    int64_t start = m->cow_start.offset - cluster_start;
+    int64_t end = m->cow_end.offset
+                + (m->cow_end.nb_sectors << BDRV_SECTOR_BITS) - cluster_start;
+    int first_sc, last_sc;
+
+    first_sc = start > 0 ? start >> s->subcluster_bits : 0;
+    last_sc = end < s->cluster_size
+            ? DIV_ROUND_UP(end, s->subcluster_size)
+            : QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+
+    return QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc);
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
@@ -734,11 +822,34 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        if (s->extended_l2) {
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t alloc = subcluster_alloc_bits(s, m, i);
+
+            if (!m->keep_old_cluster) {
+                /* The old cluster (if any) is replaced as a whole */
+                bitmap &= QCOW_L2_BITMAP_ALL_ZEROES;
+            }
+            bitmap = (bitmap & ~(alloc << 32)) | alloc;
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+
+            if (m->keep_old_cluster) {
+                /* The data was written in place, the entry stays */
+                assert(m->nb_clusters == 1);
+                assert((old_entry & L2E_OFFSET_MASK) == cluster_offset);
+                continue;
+            }
+        }
+
+        if (old_entry != 0) {
+            old_cluster[j++] = old_entry;
+        }
+
+        set_l2_entry(s, l2_table, l2_index + i,
+                     (cluster_offset + (i << s->cluster_bits)) |
+                     QCOW_OFLAG_COPIED);
      }
 
 
@@ -756,7 +867,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -775,12 +886,24 @@ err:
 static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     uint64_t *l2_table, int l2_index)
 {
+    bool first_unallocated =
+        !(get_l2_entry(s, l2_table, l2_index) & L2E_OFFSET_MASK);
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
+        /* With extended L2 entries, clusters without a host cluster only
+         * need COW for the partially written subclusters, so don't mix them
+         * with clusters that must be copied as a whole. */
+        if (s->extended_l2 &&
+            (cluster_type == QCOW2_CLUSTER_COMPRESSED ||
+             !(l2_entry & L2E_OFFSET_MASK) != first_unallocated))
+        {
+            goto out;
+        }
+
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -824,10 +947,13 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
+        /* With extended L2 entries the COW area may not cover the whole
+         * cluster, but the L2 entry is still updated for the whole cluster */
         uint64_t start = guest_offset;
         uint64_t end = start + bytes;
-        uint64_t old_start = l2meta_cow_start(old_alloc);
-        uint64_t old_end = l2meta_cow_end(old_alloc);
+        uint64_t old_start = start_of_cluster(s, l2meta_cow_start(old_alloc));
+        uint64_t old_end = align_offset(l2meta_cow_end(old_alloc),
+                                        s->cluster_size);
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
@@ -866,6 +992,38 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * With extended L2 entries, returns the number of bytes from guest_offset to
+ * the end of the last allocated subcluster that directly follows it, looking
+ * at most at nb_clusters clusters starting at l2_index. The result is 0 if
+ * the subcluster at guest_offset is not allocated.
+ */
+static uint64_t count_allocated_subcluster_bytes(BDRVQcowState *s,
+    uint64_t *l2_table, int l2_index, uint64_t guest_offset, int nb_clusters)
+{
+    int nb_sc = nb_clusters * QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    int i;
+
+    for (i = offset_to_sc_index(s, guest_offset); i < nb_sc; i++) {
+        int c = i / QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + c);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + c);
+        int sc = i % QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+
+        if (qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc)
+            != QCOW2_CLUSTER_NORMAL)
+        {
+            break;
+        }
+    }
+
+    if (i == offset_to_sc_index(s, guest_offset)) {
+        return 0;
+    }
+    return ((uint64_t) i << s->subcluster_bits)
+           - offset_into_cluster(s, guest_offset);
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -921,7 +1079,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -939,8 +1097,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -948,6 +1105,18 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
 
+        if (s->extended_l2) {
+            /* Only allocated subclusters can be overwritten in place */
+            uint64_t alloc_bytes =
+                count_allocated_subcluster_bytes(s, l2_table, l2_index,
+                                                 guest_offset, keep_clusters);
+            if (alloc_bytes == 0) {
+                ret = 0;
+                goto out;
+            }
+            *bytes = MIN(*bytes, alloc_bytes);
+        }
+
         ret = 1;
     } else {
         ret = 0;
@@ -1043,8 +1212,9 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcowState *s = bs->opaque;
     int l2_index;
     uint64_t *l2_table;
-    uint64_t entry;
+    uint64_t entry, bitmap;
     unsigned int nb_clusters;
+    bool keep_old_cluster = false;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1069,10 +1239,18 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
+    bitmap = get_l2_bitmap(s, l2_table, l2_index);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (s->extended_l2 && qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL
+        && (entry & QCOW_OFLAG_COPIED))
+    {
+        /* Write to unallocated subclusters of a cluster that we own: the
+         * data goes to the existing host cluster, only the bitmap changes */
+        keep_old_cluster = true;
+        nb_clusters = 1;
+    } else if (entry & QCOW_OFLAG_COMPRESSED) {
+        /* For the moment, overwrite compressed clusters one by one */
         nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
@@ -1090,10 +1268,20 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
+    if (keep_old_cluster) {
+        if (alloc_cluster_offset != 0 &&
+            alloc_cluster_offset != (entry & L2E_OFFSET_MASK))
+        {
+            *bytes = 0;
+            return 0;
+        }
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+    } else {
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* Can't extend contiguous allocation */
@@ -1124,8 +1312,37 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int alloc_n_start = offset_into_cluster(s, guest_offset)
                         >> BDRV_SECTOR_BITS;
     int nb_sectors = MIN(requested_sectors, avail_sectors);
+    int cow_start_sector = 0;
+    int cow_end_sector = avail_sectors;
     QCowL2Meta *old_m = *m;
 
+    /*
+     * With extended L2 entries, clusters that don't have data to copy as a
+     * whole only need COW for the first and last subcluster of the request,
+     * and not even that if the subcluster is already allocated.
+     */
+    if (s->extended_l2 && (keep_old_cluster || !(entry & L2E_OFFSET_MASK))) {
+        int sc_sectors = s->subcluster_sectors;
+
+        cow_start_sector = alloc_n_start & ~(sc_sectors - 1);
+        cow_end_sector = MIN(align_offset(nb_sectors, sc_sectors),
+                             avail_sectors);
+
+        if (keep_old_cluster) {
+            int first_sc = cow_start_sector / sc_sectors;
+            int last_sc = (cow_end_sector - 1) / sc_sectors;
+
+            if (qcow2_get_subcluster_type(entry, bitmap, first_sc)
+                == QCOW2_CLUSTER_NORMAL) {
+                cow_start_sector = alloc_n_start;
+            }
+            if (qcow2_get_subcluster_type(entry, bitmap, last_sc)
+                == QCOW2_CLUSTER_NORMAL) {
+                cow_end_sector = nb_sectors;
+            }
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1135,14 +1352,15 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .offset         = start_of_cluster(s, guest_offset),
         .nb_clusters    = nb_clusters,
         .nb_available   = nb_sectors,
+        .keep_old_cluster = keep_old_cluster,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = cow_start_sector * BDRV_SECTOR_SIZE,
+            .nb_sectors = alloc_n_start - cow_start_sector,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sector - nb_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1368,14 +1586,17 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_table, l2_index + i, 0);
+        if (s->extended_l2) {
+            set_l2_bitmap(s, l2_table, l2_index + i, 0);
+        }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1, type);
@@ -1455,15 +1676,25 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (s->extended_l2) {
+            /* Zero subclusters don't keep a host cluster */
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+            if (old_offset & L2E_OFFSET_MASK) {
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1708,6 +1939,10 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs)
     int ret;
     int i, j;
 
+    /* Only used for downgrading to compat=0.10, which doesn't know extended
+     * L2 entries anyway */
+    assert(!s->extended_l2);
+
     nb_clusters = size_to_clusters(s, bs->file->total_sectors *
                                    BDRV_SECTOR_SIZE);
     expanded_clusters = g_malloc0((nb_clusters + 7) / 8);
@@ -867,7 +867,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -926,7 +926,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_table, j, offset);
                     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
             }
@@ -990,6 +990,61 @@ fail:
 
 
 
+/*
+ * Temporary refcount table built by the image check.  Almost all clusters
+ * are referenced only a few times, so a single byte is stored per cluster;
+ * counts that don't fit are kept in a hash table.  This halves the memory
+ * needed for the check of large images.
+ */
+typedef struct CheckRefcounts {
+    uint8_t *counts;
+    GHashTable *overflow;   /* cluster index -> refcount if >= UINT8_MAX */
+    int nb_clusters;
+} CheckRefcounts;
+
+static void check_refcounts_init(CheckRefcounts *rc, int nb_clusters)
+{
+    rc->counts = g_malloc0(nb_clusters);
+    rc->overflow = g_hash_table_new(g_direct_hash, g_direct_equal);
+    rc->nb_clusters = nb_clusters;
+}
+
+static void check_refcounts_free(CheckRefcounts *rc)
+{
+    g_free(rc->counts);
+    g_hash_table_destroy(rc->overflow);
+}
+
+static void check_refcounts_resize(CheckRefcounts *rc, int nb_clusters)
+{
+    rc->counts = g_realloc(rc->counts, nb_clusters);
+    memset(&rc->counts[rc->nb_clusters], 0, nb_clusters - rc->nb_clusters);
+    rc->nb_clusters = nb_clusters;
+}
+
+static uint16_t check_refcount_get(CheckRefcounts *rc, int k)
+{
+    if (rc->counts[k] < UINT8_MAX) {
+        return rc->counts[k];
+    }
+    return GPOINTER_TO_UINT(g_hash_table_lookup(rc->overflow,
+                                                GINT_TO_POINTER(k)));
+}
+
+static void check_refcount_set(CheckRefcounts *rc, int k, uint16_t refcount)
+{
+    if (refcount < UINT8_MAX) {
+        if (rc->counts[k] == UINT8_MAX) {
+            g_hash_table_remove(rc->overflow, GINT_TO_POINTER(k));
+        }
+        rc->counts[k] = refcount;
+    } else {
+        rc->counts[k] = UINT8_MAX;
+        g_hash_table_insert(rc->overflow, GINT_TO_POINTER(k),
+                            GUINT_TO_POINTER(refcount));
+    }
+}
+
 /*
  * Increases the refcount for a range of clusters in a given refcount table.
  * This is used to construct a temporary refcount table out of L1 and L2 tables
@@ -999,12 +1054,12 @@ fail:
  */
 static void inc_refcounts(BlockDriverState *bs,
                           BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
+                          CheckRefcounts *rc,
                           int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t start, last, cluster_offset;
+    uint16_t refcount;
     int k;
 
     if (size <= 0)
@@ -1019,13 +1074,15 @@ static void inc_refcounts(BlockDriverState *bs,
             fprintf(stderr, "ERROR: invalid cluster offset=0x%" PRIx64 "\n",
                 cluster_offset);
             res->corruptions++;
-        } else if (k >= refcount_table_size) {
+        } else if (k >= rc->nb_clusters) {
             fprintf(stderr, "Warning: cluster offset=0x%" PRIx64 " is after "
                 "the end of the image file, can't properly check refcounts.\n",
                 cluster_offset);
             res->check_errors++;
         } else {
-            if (++refcount_table[k] == 0) {
+            refcount = check_refcount_get(rc, k) + 1;
+            check_refcount_set(rc, k, refcount);
+            if (refcount == 0) {
                 fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
                 res->corruptions++;
@@ -1041,31 +1098,32 @@ enum {
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
- *
- * Returns the number of errors found by the checks or -errno if an internal
- * error occurred.
+ * referenced in the L2 table, which has already been read into memory. While
+ * doing so, performs some checks on L2 entries.
  */
-static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int flags)
+static void check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
+    CheckRefcounts *rc, uint64_t *l2_table, int flags)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    int i, nb_csectors;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (s->extended_l2) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+            if (!(l2_entry & L2E_OFFSET_MASK) &&
+                (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)) {
+                fprintf(stderr, "ERROR: L2 entry %" PRIx64 " has allocated "
+                    "subclusters (bitmap %" PRIx64 ") but no host cluster\n",
+                    l2_entry, l2_bitmap);
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1082,8 +1140,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_entry & ~511, nb_csectors * 512);
+            inc_refcounts(bs, res, rc, l2_entry & ~511, nb_csectors * 512);
 
             if (flags & CHECK_FRAG_INFO) {
                 res->bfi.allocated_clusters++;
@@ -1118,8 +1175,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
-                offset, s->cluster_size);
+            inc_refcounts(bs, res, rc, offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
             if (offset & (s->cluster_size - 1)) {
@@ -1137,14 +1193,51 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             abort();
         }
     }
+}
 
-    g_free(l2_table);
-    return 0;
+/* Number of L2 tables that check_refcounts_l1() reads ahead */
+#define CHECK_L2_READAHEAD 16
 
-fail:
-    fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
-    return -EIO;
+typedef struct CheckL2Read {
+    BlockDriverState *bs;
+    int64_t offset;
+    void *buf;
+    int size;
+    int ret;
+} CheckL2Read;
+
+static void coroutine_fn check_l2_read_entry(void *opaque)
+{
+    CheckL2Read *r = opaque;
+
+    r->ret = bdrv_pread(r->bs->file, r->offset, r->buf, r->size);
+}
+
+/*
+ * Starts reading an L2 table.  Unless we are already in coroutine context
+ * (where the read is done synchronously), each read runs in a coroutine of
+ * its own so that several of them can be in flight.
+ */
+static void check_l2_read_start(CheckL2Read *r, int64_t offset)
+{
+    Coroutine *co;
+
+    r->offset = offset;
+    r->ret = -EINPROGRESS;
+    if (qemu_in_coroutine()) {
+        check_l2_read_entry(r);
+    } else {
+        co = qemu_coroutine_create(check_l2_read_entry);
+        qemu_coroutine_enter(co, r);
+    }
+}
+
+static int check_l2_read_wait(CheckL2Read *r)
+{
+    while (r->ret == -EINPROGRESS) {
+        qemu_aio_wait();
+    }
+    return r->ret;
 }
 
 /*
@@ -1157,20 +1250,28 @@ fail:
  */
 static int check_refcounts_l1(BlockDriverState *bs,
                               BdrvCheckResult *res,
-                              uint16_t *refcount_table,
-                              int refcount_table_size,
+                              CheckRefcounts *rc,
                               int64_t l1_table_offset, int l1_size,
                               int flags)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, l2_offset, l1_size2;
-    int i, ret;
+    CheckL2Read reads[CHECK_L2_READAHEAD];
+    int l2_size = s->l2_size * l2_entry_size(s);
+    int i, next;
 
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
-        l1_table_offset, l1_size2);
+    inc_refcounts(bs, res, rc, l1_table_offset, l1_size2);
+
+    for (i = 0; i < CHECK_L2_READAHEAD; i++) {
+        reads[i] = (CheckL2Read) {
+            .bs     = bs,
+            .buf    = NULL,
+            .size   = l2_size,
+        };
+    }
 
     /* Read L1 table entries from disk */
     if (l1_size2 == 0) {
@@ -1184,14 +1285,28 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
-    /* Do the actual checks */
+    /* Do the actual checks.  The L2 tables are processed in order, but the
+     * next CHECK_L2_READAHEAD ones are read concurrently in the meantime. */
+    next = 0;
     for(i = 0; i < l1_size; i++) {
+        CheckL2Read *r = &reads[i % CHECK_L2_READAHEAD];
+
+        while (next < l1_size && next < i + CHECK_L2_READAHEAD) {
+            if (l1_table[next]) {
+                CheckL2Read *ra = &reads[next % CHECK_L2_READAHEAD];
+                if (!ra->buf) {
+                    ra->buf = g_malloc(l2_size);
+                }
+                check_l2_read_start(ra, l1_table[next] & L1E_OFFSET_MASK);
+            }
+            next++;
+        }
+
         l2_offset = l1_table[i];
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
-                l2_offset, s->cluster_size);
+            inc_refcounts(bs, res, rc, l2_offset, s->cluster_size);
 
             /* L2 tables are cluster aligned */
             if (l2_offset & (s->cluster_size - 1)) {
@@ -1201,19 +1316,30 @@ static int check_refcounts_l1(BlockDriverState *bs,
             }
 
             /* Process and check L2 entries */
-            ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
-            if (ret < 0) {
+            if (check_l2_read_wait(r) != l2_size) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
                 goto fail;
             }
+            check_refcounts_l2(bs, res, rc, r->buf, flags);
         }
     }
+
+    for (i = 0; i < CHECK_L2_READAHEAD; i++) {
+        g_free(reads[i].buf);
+    }
     g_free(l1_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
     res->check_errors++;
+    /* Don't free buffers that are still being read into */
+    for (i = 0; i < CHECK_L2_READAHEAD; i++) {
+        if (reads[i].buf) {
+            check_l2_read_wait(&reads[i]);
+            g_free(reads[i].buf);
+        }
+    }
     g_free(l1_table);
     return -EIO;
 }
@@ -1271,7 +1397,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+                         s->l2_size * l2_entry_size(s));
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1280,7 +1406,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1298,9 +1424,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
@@ -1463,23 +1589,22 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     int64_t size, i, highest_cluster;
     int nb_clusters, refcount1, refcount2;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
+    CheckRefcounts rc;
     int ret;
 
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
-    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+    check_refcounts_init(&rc, nb_clusters);
 
     res->bfi.total_clusters =
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        0, s->cluster_size);
+    inc_refcounts(bs, res, &rc, 0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
-                             s->l1_table_offset, s->l1_size, CHECK_FRAG_INFO);
+    ret = check_refcounts_l1(bs, res, &rc, s->l1_table_offset, s->l1_size,
+                             CHECK_FRAG_INFO);
     if (ret < 0) {
         goto fail;
     }
@@ -1487,17 +1612,16 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+        ret = check_refcounts_l1(bs, res, &rc,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
-        s->snapshots_offset, s->snapshots_size);
+    inc_refcounts(bs, res, &rc, s->snapshots_offset, s->snapshots_size);
 
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &rc,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1522,14 +1646,13 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
-                offset, s->cluster_size);
-            if (refcount_table[cluster] != 1) {
+            inc_refcounts(bs, res, &rc, offset, s->cluster_size);
+            if (check_refcount_get(&rc, cluster) != 1) {
                 fprintf(stderr, "%s refcount block %" PRId64
                     " refcount=%d\n",
                     fix & BDRV_FIX_ERRORS ? "Repairing" :
                                             "ERROR",
-                    i, refcount_table[cluster]);
+                    i, check_refcount_get(&rc, cluster));
 
                 if (fix & BDRV_FIX_ERRORS) {
                     int64_t new_offset;
@@ -1543,16 +1666,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                     /* update refcounts */
                     if ((new_offset >> s->cluster_bits) >= nb_clusters) {
                         /* increase refcount_table size if necessary */
-                        int old_nb_clusters = nb_clusters;
                         nb_clusters = (new_offset >> s->cluster_bits) + 1;
-                        refcount_table = g_realloc(refcount_table,
-                                nb_clusters * sizeof(uint16_t));
-                        memset(&refcount_table[old_nb_clusters], 0, (nb_clusters
-                                - old_nb_clusters) * sizeof(uint16_t));
+                        check_refcounts_resize(&rc, nb_clusters);
                     }
-                    refcount_table[cluster]--;
-                    inc_refcounts(bs, res, refcount_table, nb_clusters,
-                            new_offset, s->cluster_size);
+                    check_refcount_set(&rc, cluster,
+                                       check_refcount_get(&rc, cluster) - 1);
+                    inc_refcounts(bs, res, &rc, new_offset, s->cluster_size);
 
                     res->corruptions_fixed++;
                 } else {
@@ -1572,7 +1691,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             continue;
         }
 
-        refcount2 = refcount_table[i];
+        refcount2 = check_refcount_get(&rc, i);
 
         if (refcount1 > 0 || refcount2 > 0) {
             highest_cluster = i;
@@ -1623,7 +1742,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     ret = 0;
 
 fail:
-    g_free(refcount_table);
+    check_refcounts_free(&rc);
 
     return ret;
 }
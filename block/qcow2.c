@@ -27,6 +27,7 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
@@ -548,7 +549,22 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+
+    s->extended_l2 = s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+    if (s->extended_l2) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Extended L2 entries require a cluster size of "
+                       "at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subcluster_bits = s->cluster_bits - 5;
+        s->subcluster_size = 1 << s->subcluster_bits;
+        s->subcluster_sectors = s->subcluster_size >> BDRV_SECTOR_BITS;
+    }
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - (s->extended_l2 ? 4 : 3);
     s->l2_size = 1 << s->l2_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
@@ -1313,6 +1329,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -1512,6 +1533,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        header.incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not write qcow2 header");
@@ -1651,6 +1676,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTENDED_L2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTENDED_L2 : 0;
         }
         options++;
     }
@@ -1667,6 +1694,20 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options,
         return -EINVAL;
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        if (version < 3) {
+            error_setg(errp, "Extended L2 entries only supported with "
+                       "compatibility level 1.1 and above (use compat=1.1 or "
+                       "greater)");
+            return -EINVAL;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            error_setg(errp, "Extended L2 entries require a cluster size of "
+                       "at least %d bytes", 1 << MIN_EXTL2_CLUSTER_BITS);
+            return -EINVAL;
+        }
+    }
+
     ret = qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, options, version, &local_err);
     if (error_is_set(&local_err)) {
@@ -1769,13 +1810,76 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    uint8_t *dest;
+    const uint8_t *src;
+    size_t size;
+} Qcow2CompressData;
+
+/*
+ * Compress one cluster of @size bytes from @src into @dest, which must be at
+ * least @size bytes large.  Returns the compressed length, -ENOSPC if the
+ * data does not compress, or -EINVAL on zlib errors.
+ */
+static int qcow2_compress(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - data->dest;
+    deflateEnd(&strm);
+
+    if (ret == Z_STREAM_END && out_len < data->size) {
+        return out_len;
+    } else if (ret == Z_STREAM_END || ret == Z_OK) {
+        return -ENOSPC;
+    }
+    return -EINVAL;
+}
+
+/*
+ * When called from coroutine context, compression is done in the thread
+ * pool so that several compressed writes can make progress in parallel
+ * (e.g. qemu-img convert -c -W).
+ */
+static int qcow2_do_compress(BlockDriverState *bs, uint8_t *dest,
+                             const uint8_t *src, size_t size)
+{
+    Qcow2CompressData data = {
+        .dest = dest,
+        .src  = src,
+        .size = size,
+    };
+
+    if (qemu_in_coroutine()) {
+        ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        return thread_pool_submit_co(pool, qcow2_compress, &data);
+    }
+    return qcow2_compress(&data);
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -1807,53 +1911,41 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    out_len = qcow2_do_compress(bs, out_buf, buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
+        /* Allocation and the L2 update may yield; serialise them against
+         * other requests when running in a coroutine */
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
         if (!cluster_offset) {
             ret = -EIO;
-            goto fail;
+            goto fail_unlock;
         }
         cluster_offset &= s->cluster_offset_mask;
 
         ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
         if (ret < 0) {
-            goto fail;
+            goto fail_unlock;
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+fail_unlock:
+        if (qemu_in_coroutine()) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1894,6 +1986,7 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+    bdi->unallocated_blocks_are_zero = !bs->backing_hd;
     return 0;
 }
 
@@ -1918,6 +2011,8 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .lazy_refcounts     = s->compatible_features &
                                   QCOW2_COMPAT_LAZY_REFCOUNTS,
             .has_lazy_refcounts = true,
+            .extended_l2        = s->extended_l2,
+            .has_extended_l2    = s->extended_l2,
         };
     }
 
@@ -2016,6 +2111,12 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version)
         return -ENOTSUP;
     }
 
+    if (s->extended_l2) {
+        error_report("qcow2_downgrade: Images with extended L2 entries cannot "
+                     "be downgraded to compat=0.10.");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2107,6 +2208,12 @@ static int qcow2_amend_options(BlockDriverState *bs,
             }
         } else if (!strcmp(options[i].name, "lazy_refcounts")) {
             lazy_refcounts = options[i].value.n;
+        } else if (!strcmp(options[i].name, "extended_l2")) {
+            if (options[i].value.n != s->extended_l2) {
+                fprintf(stderr, "Changing extended L2 entries is not "
+                        "supported.\n");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2222,6 +2329,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTENDED_L2,
+        .type = OPT_FLAG,
+        .help = "Extended L2 entries with subcluster allocation",
+    },
     { NULL }
 };
 
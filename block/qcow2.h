@@ -46,11 +46,26 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* With extended L2 entries, each cluster is split into 32 subclusters whose
+ * state is kept in a second 64 bit word after the normal L2 entry: bit x is
+ * set if subcluster x is allocated, bit x + 32 if it reads as zeros. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(x)     (1ULL << (x))
+#define QCOW_OFLAG_SUB_ZERO(x)      (QCOW_OFLAG_SUB_ALLOC(x) << 32)
+/* Subclusters [x, y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(x, y) \
+    (QCOW_OFLAG_SUB_ALLOC(y) - QCOW_OFLAG_SUB_ALLOC(x))
+#define QCOW_L2_BITMAP_ALL_ALLOC    QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32)
+#define QCOW_L2_BITMAP_ALL_ZEROES   (QCOW_L2_BITMAP_ALL_ALLOC << 32)
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Subclusters must still be at least one sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 #define L2_CACHE_SIZE 16
 
 /* Must be at least 4 to cover all cases of refcount table growth */
@@ -129,11 +144,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -172,6 +190,10 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    bool extended_l2;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -270,6 +292,13 @@ typedef struct QCowL2Meta
     /** Number of newly allocated clusters */
     int nb_clusters;
 
+    /**
+     * With extended L2 entries: the request writes to unallocated subclusters
+     * of an existing cluster, which is kept instead of being replaced by
+     * alloc_offset (which is the same host cluster in this case).
+     */
+    bool keep_old_cluster;
+
     /**
      * Requests that overlap with this allocation and wait to be restarted
      * when the allocating request has completed.
@@ -383,6 +412,48 @@ static inline int64_t qcow2_vm_state_offset(BDRVQcowState *s)
     return (int64_t)s->l1_vm_state_index << (s->cluster_bits + s->l2_bits);
 }
 
+/* Size of an L2 entry in bytes (including the subcluster bitmap, if any) */
+static inline int l2_entry_size(BDRVQcowState *s)
+{
+    return s->extended_l2 ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_table[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    if (!s->extended_l2) {
+        return 0;
+    }
+    return be64_to_cpu(l2_table[2 * idx + 1]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_table[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(s->extended_l2);
+    l2_table[2 * idx + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) &
+           (QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER - 1);
+}
+
 static inline int qcow2_get_cluster_type(uint64_t l2_entry)
 {
     if (l2_entry & QCOW_OFLAG_COMPRESSED) {
@@ -396,6 +467,26 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Type of subcluster @sc of a cluster with extended L2 entry
+ * (@l2_entry, @l2_bitmap), using the QCOW2_CLUSTER_* values: allocated
+ * subclusters are NORMAL, unallocated ones are read from the backing file.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if ((l2_entry & L2E_OFFSET_MASK) &&
+               (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc))) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -0,0 +1,469 @@
+/*
+ * Shared read cache for backing images
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/coroutine.h"
+#include "qemu/queue.h"
+#include "qemu/module.h"
+
+#define READCACHE_CLUSTER_BITS      16
+#define READCACHE_CLUSTER_SIZE      (1 << READCACHE_CLUSTER_BITS)
+#define READCACHE_CLUSTER_SECTORS   (READCACHE_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
+#define READCACHE_DEFAULT_SIZE      (64 * 1024 * 1024)
+
+typedef struct ReadCacheEntry {
+    int64_t cluster;            /* hash key, must stay first */
+    uint8_t *data;
+    int bytes;                  /* valid bytes, less at the end of the image */
+    bool loading;               /* a coroutine is reading the cluster */
+    bool stale;                 /* overwritten while loading */
+    CoQueue waiters;            /* coroutines waiting for the load */
+    QTAILQ_ENTRY(ReadCacheEntry) lru;
+} ReadCacheEntry;
+
+/*
+ * A cache is shared by all readcache nodes of the process that open the same
+ * image, so that e.g. many overlays on top of one base image read each of
+ * its clusters only once.  The nodes also share a single instance of the
+ * image: metadata that is cached by the image's driver must be the same for
+ * all of them, or allocating writes through one node would go unnoticed by
+ * the others.
+ */
+typedef struct ReadCache {
+    char *key;
+    int refcount;
+    BlockDriverState *image;
+    GHashTable *entries;
+    QTAILQ_HEAD(ReadCacheEntryList, ReadCacheEntry) lru; /* most recent first */
+    int nb_entries;
+    int max_entries;
+    QLIST_ENTRY(ReadCache) next;
+} ReadCache;
+
+static QLIST_HEAD(, ReadCache) read_caches =
+    QLIST_HEAD_INITIALIZER(read_caches);
+
+typedef struct BDRVReadCacheState {
+    BlockDriverState *image;    /* owned by the cache */
+    ReadCache *cache;
+} BDRVReadCacheState;
+
+static void readcache_free_entry(ReadCache *c, ReadCacheEntry *e)
+{
+    g_hash_table_remove(c->entries, &e->cluster);
+    if (!e->loading) {
+        QTAILQ_REMOVE(&c->lru, e, lru);
+        c->nb_entries--;
+    }
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+static void readcache_evict(ReadCache *c)
+{
+    ReadCacheEntry *e;
+
+    while (c->nb_entries > c->max_entries) {
+        e = QTAILQ_LAST(&c->lru, ReadCacheEntryList);
+        readcache_free_entry(c, e);
+    }
+}
+
+/*
+ * Attach @s to the cache for @key, opening @filename with @flags if the cache
+ * does not exist yet.  An image that is already open is reused with the flags
+ * that it was opened with, except that it is made writable if needed.
+ */
+static int readcache_get(BDRVReadCacheState *s, const char *key,
+                         const char *filename, int flags, int max_entries,
+                         Error **errp)
+{
+    BlockDriverState *image;
+    ReadCache *c;
+    int ret;
+
+    QLIST_FOREACH(c, &read_caches, next) {
+        if (!strcmp(c->key, key)) {
+            break;
+        }
+    }
+
+    if (c) {
+        if ((flags & BDRV_O_RDWR) && bdrv_is_read_only(c->image)) {
+            ret = bdrv_reopen(c->image, bdrv_get_flags(c->image) | BDRV_O_RDWR,
+                              errp);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        c->refcount++;
+        c->max_entries = MAX(c->max_entries, max_entries);
+        goto out;
+    }
+
+    image = bdrv_new("");
+    ret = bdrv_open(image, filename, NULL, flags, NULL, errp);
+    if (ret < 0) {
+        bdrv_unref(image);
+        return ret;
+    }
+
+    c = g_malloc0(sizeof(*c));
+    c->key = g_strdup(key);
+    c->refcount = 1;
+    c->image = image;
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->max_entries = max_entries;
+    QTAILQ_INIT(&c->lru);
+    QLIST_INSERT_HEAD(&read_caches, c, next);
+
+out:
+    s->cache = c;
+    s->image = c->image;
+    return 0;
+}
+
+static void readcache_put(ReadCache *c)
+{
+    ReadCacheEntry *e, *next;
+
+    if (--c->refcount > 0) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, lru, next) {
+        readcache_free_entry(c, e);
+    }
+    assert(g_hash_table_size(c->entries) == 0);
+    g_hash_table_destroy(c->entries);
+    bdrv_unref(c->image);
+    QLIST_REMOVE(c, next);
+    g_free(c->key);
+    g_free(c);
+}
+
+/* Valid readcache filenames look like readcache:path/to/image */
+static void readcache_parse_filename(const char *filename, QDict *options,
+                                     Error **errp)
+{
+    if (!strstart(filename, "readcache:", &filename)) {
+        error_setg(errp, "File name string must start with 'readcache:'");
+        return;
+    }
+
+    qdict_put(options, "image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "readcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "image",
+            .type = QEMU_OPT_STRING,
+            .help = "Filename of the cached image",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the shared cache in bytes",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int readcache_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    char *key;
+    uint64_t cache_size;
+    int ret;
+
+    opts = qemu_opts_create_nofail(&runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    filename = qemu_opt_get(opts, "image");
+    if (filename == NULL) {
+        error_setg(errp, "Could not retrieve image filename");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size", READCACHE_DEFAULT_SIZE);
+    if (cache_size < READCACHE_CLUSTER_SIZE ||
+        cache_size / READCACHE_CLUSTER_SIZE > INT_MAX) {
+        error_setg(errp, "Invalid cache size");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Different paths to the same file must share the cache */
+#ifndef _WIN32
+    key = realpath(filename, NULL);
+#else
+    key = NULL;
+#endif
+    ret = readcache_get(s, key ? key : filename, filename, flags,
+                        cache_size / READCACHE_CLUSTER_SIZE, &local_err);
+    free(key);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    ret = 0;
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void readcache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    readcache_put(s->cache);
+    s->cache = NULL;
+    s->image = NULL;
+}
+
+static int64_t readcache_getlength(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    return bdrv_getlength(s->image);
+}
+
+/*
+ * Return the loaded cache entry for @cluster, reading it from the image on a
+ * miss.  Concurrent misses for the same cluster wait for the first reader
+ * instead of reading it again.
+ */
+static ReadCacheEntry *coroutine_fn readcache_co_get_entry(BlockDriverState *bs,
+                                                           int64_t cluster,
+                                                           int *ret)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *c = s->cache;
+    ReadCacheEntry *e;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t nb_sectors;
+
+    for (;;) {
+        e = g_hash_table_lookup(c->entries, &cluster);
+        if (!e) {
+            break;
+        }
+        if (!e->loading) {
+            QTAILQ_REMOVE(&c->lru, e, lru);
+            QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+            return e;
+        }
+        qemu_co_queue_wait(&e->waiters);
+    }
+
+    e = g_malloc0(sizeof(*e));
+    e->cluster = cluster;
+    e->loading = true;
+    e->data = qemu_blockalign(s->image, READCACHE_CLUSTER_SIZE);
+    qemu_co_queue_init(&e->waiters);
+    g_hash_table_insert(c->entries, &e->cluster, e);
+
+    nb_sectors = MIN(READCACHE_CLUSTER_SECTORS,
+                     bs->total_sectors - cluster * READCACHE_CLUSTER_SECTORS);
+    e->bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = e->data;
+    iov.iov_len = e->bytes;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    *ret = bdrv_co_readv(s->image, cluster * READCACHE_CLUSTER_SECTORS,
+                         nb_sectors, &qiov);
+
+    e->loading = false;
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+    c->nb_entries++;
+    qemu_co_queue_restart_all(&e->waiters);
+
+    if (*ret < 0 || e->stale) {
+        /* The data can still be used for this request, but not cached */
+        readcache_free_entry(c, e);
+        return NULL;
+    }
+
+    readcache_evict(c);
+    return e;
+}
+
+static int coroutine_fn readcache_co_readv(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheEntry *e;
+    size_t qiov_offset = 0;
+    int64_t cluster;
+    int offset, bytes;
+    int ret = 0;
+
+    while (nb_sectors > 0) {
+        cluster = sector_num / READCACHE_CLUSTER_SECTORS;
+        offset = (sector_num % READCACHE_CLUSTER_SECTORS) * BDRV_SECTOR_SIZE;
+        bytes = MIN(nb_sectors * BDRV_SECTOR_SIZE,
+                    READCACHE_CLUSTER_SIZE - offset);
+
+        e = readcache_co_get_entry(bs, cluster, &ret);
+        if (e) {
+            assert(offset + bytes <= e->bytes);
+            qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset, bytes);
+        } else {
+            /* Failed or raced with a write, go to the image directly */
+            QEMUIOVector local_qiov;
+
+            qemu_iovec_init(&local_qiov, qiov->niov);
+            qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+            ret = bdrv_co_readv(s->image, sector_num,
+                                bytes / BDRV_SECTOR_SIZE, &local_qiov);
+            qemu_iovec_destroy(&local_qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        qiov_offset += bytes;
+        sector_num += bytes / BDRV_SECTOR_SIZE;
+        nb_sectors -= bytes / BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/* Drop cached clusters that a write touches, in every node sharing them */
+static void readcache_invalidate(ReadCache *c, int64_t sector_num,
+                                 int nb_sectors)
+{
+    ReadCacheEntry *e;
+    int64_t cluster, end;
+
+    cluster = sector_num / READCACHE_CLUSTER_SECTORS;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, READCACHE_CLUSTER_SECTORS);
+    for (; cluster < end; cluster++) {
+        e = g_hash_table_lookup(c->entries, &cluster);
+        if (!e) {
+            continue;
+        }
+        if (e->loading) {
+            e->stale = true;
+        } else {
+            readcache_free_entry(c, e);
+        }
+    }
+}
+
+static int coroutine_fn readcache_co_writev(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    readcache_invalidate(s->cache, sector_num, nb_sectors);
+    ret = bdrv_co_writev(s->image, sector_num, nb_sectors, qiov);
+    readcache_invalidate(s->cache, sector_num, nb_sectors);
+    return ret;
+}
+
+static int coroutine_fn readcache_co_write_zeroes(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    readcache_invalidate(s->cache, sector_num, nb_sectors);
+    ret = bdrv_co_write_zeroes(s->image, sector_num, nb_sectors);
+    readcache_invalidate(s->cache, sector_num, nb_sectors);
+    return ret;
+}
+
+static int coroutine_fn readcache_co_discard(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    readcache_invalidate(s->cache, sector_num, nb_sectors);
+    ret = bdrv_co_discard(s->image, sector_num, nb_sectors);
+    readcache_invalidate(s->cache, sector_num, nb_sectors);
+    return ret;
+}
+
+static int coroutine_fn readcache_co_flush(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    return bdrv_co_flush(s->image);
+}
+
+static int64_t coroutine_fn readcache_co_get_block_status(BlockDriverState *bs,
+                                                          int64_t sector_num,
+                                                          int nb_sectors,
+                                                          int *pnum)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t ret;
+
+    ret = bdrv_get_block_status(s->image, sector_num, nb_sectors, pnum);
+    if (ret < 0) {
+        return ret;
+    }
+    /* Offsets refer to the protocol layer of the image, not to us */
+    return ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO);
+}
+
+static int readcache_has_zero_init(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    return bdrv_has_zero_init(s->image);
+}
+
+static BlockDriver bdrv_readcache = {
+    .format_name                = "readcache",
+    .protocol_name              = "readcache",
+    .instance_size              = sizeof(BDRVReadCacheState),
+
+    .bdrv_parse_filename        = readcache_parse_filename,
+    .bdrv_file_open             = readcache_open,
+    .bdrv_close                 = readcache_close,
+    .bdrv_getlength             = readcache_getlength,
+    .bdrv_has_zero_init         = readcache_has_zero_init,
+
+    .bdrv_co_readv              = readcache_co_readv,
+    .bdrv_co_writev             = readcache_co_writev,
+    .bdrv_co_write_zeroes       = readcache_co_write_zeroes,
+    .bdrv_co_discard            = readcache_co_discard,
+    .bdrv_co_flush_to_disk      = readcache_co_flush,
+    .bdrv_co_get_block_status   = readcache_co_get_block_status,
+};
+
+static void bdrv_readcache_init(void)
+{
+    bdrv_register(&bdrv_readcache);
+}
+
+block_init(bdrv_readcache_init);
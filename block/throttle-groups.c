@@ -0,0 +1,264 @@
+/*
+ * QEMU block throttling group infrastructure
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "block/throttle-groups.h"
+#include "trace.h"
+
+/*
+ * A throttle group is a set of BlockDriverStates that share one set of I/O
+ * limits. All members account their requests in the same ThrottleState, and
+ * a single pair of timers (read and write) is used for the whole group.
+ *
+ * Each member keeps its own queues of throttled requests. When the group has
+ * budget again, requests are released from the members in round-robin order
+ * (tokens[] points to the member that was served last), so that one busy
+ * device cannot starve the others.
+ *
+ * Devices that have I/O limits but no explicit group get a group of their
+ * own, named after the device.
+ */
+struct ThrottleGroup {
+    char *name;
+    unsigned refcount;
+    ThrottleState ts;
+    QLIST_HEAD(, BlockDriverState) head;
+    BlockDriverState *tokens[2];
+    unsigned nb_waiting[2];
+    QTAILQ_ENTRY(ThrottleGroup) list;
+};
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+/* Returns the member after @bs in round-robin order */
+static BlockDriverState *throttle_group_next_member(ThrottleGroup *tg,
+                                                    BlockDriverState *bs)
+{
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    return next ? next : QLIST_FIRST(&tg->head);
+}
+
+/*
+ * Returns the next member (after the current token) that has throttled
+ * requests of the given type and makes it the new token, or NULL if no
+ * member is waiting.
+ */
+static BlockDriverState *throttle_group_next_bs(ThrottleGroup *tg,
+                                                bool is_write)
+{
+    BlockDriverState *start = tg->tokens[is_write];
+    BlockDriverState *bs = start;
+
+    if (!tg->nb_waiting[is_write] || !start) {
+        return NULL;
+    }
+
+    do {
+        bs = throttle_group_next_member(tg, bs);
+        if (!qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
+            tg->tokens[is_write] = bs;
+            return bs;
+        }
+    } while (bs != start);
+
+    return NULL;
+}
+
+/*
+ * Releases the next throttled request of the group, unless the group is out
+ * of budget, in which case the group timer is armed and does it later.
+ */
+static void throttle_group_schedule_next(ThrottleGroup *tg, bool is_write)
+{
+    BlockDriverState *bs;
+
+    if (!tg->nb_waiting[is_write]) {
+        return;
+    }
+
+    if (throttle_schedule_timer(&tg->ts, is_write)) {
+        return;
+    }
+
+    bs = throttle_group_next_bs(tg, is_write);
+    if (bs) {
+        qemu_co_queue_next(&bs->throttled_reqs[is_write]);
+    }
+}
+
+static void throttle_group_timer_cb(ThrottleGroup *tg, bool is_write)
+{
+    BlockDriverState *bs = throttle_group_next_bs(tg, is_write);
+
+    trace_throttle_group_timer_cb(tg->name, is_write, bs);
+
+    if (bs) {
+        qemu_co_enter_next(&bs->throttled_reqs[is_write]);
+    }
+}
+
+static void throttle_group_read_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, false);
+}
+
+static void throttle_group_write_timer_cb(void *opaque)
+{
+    throttle_group_timer_cb(opaque, true);
+}
+
+static ThrottleGroup *throttle_group_find(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(tg->name, name)) {
+            return tg;
+        }
+    }
+    return NULL;
+}
+
+const char *throttle_group_get_name(BlockDriverState *bs)
+{
+    return bs->throttle_group->name;
+}
+
+/*
+ * Adds @bs to the throttle group @groupname, creating the group if it doesn't
+ * exist yet. If @groupname is NULL, the device name is used.
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg;
+
+    assert(!bs->throttle_group);
+
+    if (!groupname) {
+        groupname = bdrv_get_device_name(bs);
+    }
+
+    tg = throttle_group_find(groupname);
+    if (!tg) {
+        tg = g_new0(ThrottleGroup, 1);
+        tg->name = g_strdup(groupname);
+        throttle_init(&tg->ts, QEMU_CLOCK_VIRTUAL,
+                      throttle_group_read_timer_cb,
+                      throttle_group_write_timer_cb,
+                      tg);
+        QLIST_INIT(&tg->head);
+        QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+    }
+
+    tg->refcount++;
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+    if (!tg->tokens[0]) {
+        tg->tokens[0] = bs;
+        tg->tokens[1] = bs;
+    }
+    bs->throttle_group = tg;
+
+    trace_throttle_group_register_bs(bs, tg->name, tg->refcount);
+}
+
+/*
+ * Removes @bs from its throttle group. The throttled requests of @bs must
+ * have been restarted before. The group is freed with its last member.
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int i;
+
+    assert(tg && tg->refcount > 0);
+    assert(qemu_co_queue_empty(&bs->throttled_reqs[0]));
+    assert(qemu_co_queue_empty(&bs->throttled_reqs[1]));
+
+    for (i = 0; i < 2; i++) {
+        if (tg->tokens[i] == bs) {
+            BlockDriverState *next = throttle_group_next_member(tg, bs);
+            tg->tokens[i] = (next == bs) ? NULL : next;
+        }
+    }
+
+    QLIST_REMOVE(bs, round_robin);
+    bs->throttle_group = NULL;
+
+    trace_throttle_group_unregister_bs(bs, tg->name, tg->refcount - 1);
+
+    if (--tg->refcount == 0) {
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        throttle_destroy(&tg->ts);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
+
+/*
+ * Sets the limits of the group that @bs belongs to; they apply to all of its
+ * members. Throttled requests are restarted so that they are accounted with
+ * the new configuration.
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+    int i;
+
+    throttle_config(&tg->ts, cfg);
+
+    /* throttle_config() cancelled the timers, restart the queues instead */
+    for (i = 0; i < 2; i++) {
+        BlockDriverState *next = throttle_group_next_bs(tg, i);
+        if (next) {
+            qemu_co_enter_next(&next->throttled_reqs[i]);
+        }
+    }
+}
+
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(&bs->throttle_group->ts, cfg);
+}
+
+/*
+ * Makes the request wait if the group is over its limits, or if other
+ * requests of the same type are already waiting in the group (so that they
+ * are served in round-robin order), then accounts the request.
+ *
+ * @bytes:    the size of the request
+ * @is_write: is the request a write
+ */
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        uint64_t bytes,
+                                                        bool is_write)
+{
+    ThrottleGroup *tg = bs->throttle_group;
+
+    if (tg->nb_waiting[is_write] ||
+        throttle_schedule_timer(&tg->ts, is_write)) {
+        tg->nb_waiting[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        tg->nb_waiting[is_write]--;
+    }
+
+    /* the request will be executed, do the accounting */
+    throttle_account(&tg->ts, is_write, bytes);
+
+    /* let the next waiting request of the group go, if there is budget */
+    throttle_group_schedule_next(tg, is_write);
+}
@@ -81,7 +81,8 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Maximum number of L2 tables cached per extent */
+#define L2_CACHE_SIZE 64
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -101,9 +102,14 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
-    uint32_t *l2_cache;
+    /* L2 table cache, entries are allocated on first use and replaced in
+     * LRU order.  An l2_cache_lru value of 0 means the entry is empty. */
+    unsigned int l2_cache_size;
+    uint32_t *l2_cache[L2_CACHE_SIZE];
     uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint64_t l2_cache_lru[L2_CACHE_SIZE];
+    uint64_t l2_cache_lru_counter;
+    unsigned int l2_cache_last;
 
     int64_t cluster_sectors;
     char *type;
@@ -129,6 +135,7 @@ typedef struct VmdkMetaData {
     unsigned int l2_index;
     unsigned int l2_offset;
     int valid;
+    bool new_allocation;
     uint32_t *l2_cache_entry;
 } VmdkMetaData;
 
@@ -208,14 +215,16 @@ static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
 
 static void vmdk_free_extents(BlockDriverState *bs)
 {
-    int i;
+    int i, j;
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *e;
 
     for (i = 0; i < s->num_extents; i++) {
         e = &s->extents[i];
         g_free(e->l1_table);
-        g_free(e->l2_cache);
+        for (j = 0; j < L2_CACHE_SIZE; j++) {
+            g_free(e->l2_cache[j]);
+        }
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -480,8 +489,7 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
-    extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    extent->l2_cache_size = MIN(extent->l1_size, L2_CACHE_SIZE);
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -947,6 +955,47 @@ static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data)
     return VMDK_OK;
 }
 
+/*
+ * Returns the L2 table at @l2_offset (in sectors) from the cache, reading it
+ * into the least recently used entry on a miss.  Returns NULL on error.
+ */
+static uint32_t *vmdk_l2_cache_get(VmdkExtent *extent, uint32_t l2_offset)
+{
+    size_t table_size = extent->l2_size * sizeof(uint32_t);
+    unsigned int i, victim = 0;
+
+    i = extent->l2_cache_last;
+    if (extent->l2_cache_lru[i] && extent->l2_cache_offsets[i] == l2_offset) {
+        goto found;
+    }
+
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        if (extent->l2_cache_lru[i] &&
+            extent->l2_cache_offsets[i] == l2_offset) {
+            goto found;
+        }
+        if (extent->l2_cache_lru[i] < extent->l2_cache_lru[victim]) {
+            victim = i;
+        }
+    }
+
+    i = victim;
+    if (!extent->l2_cache[i]) {
+        extent->l2_cache[i] = g_malloc(table_size);
+    }
+    extent->l2_cache_lru[i] = 0;
+    if (bdrv_pread(extent->file, (int64_t)l2_offset * 512,
+                   extent->l2_cache[i], table_size) != table_size) {
+        return NULL;
+    }
+    extent->l2_cache_offsets[i] = l2_offset;
+
+found:
+    extent->l2_cache_lru[i] = ++extent->l2_cache_lru_counter;
+    extent->l2_cache_last = i;
+    return extent->l2_cache[i];
+}
+
 static int get_cluster_offset(BlockDriverState *bs,
                                     VmdkExtent *extent,
                                     VmdkMetaData *m_data,
@@ -955,12 +1004,12 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table;
+    uint32_t *l2_table;
     bool zeroed = false;
 
     if (m_data) {
         m_data->valid = 0;
+        m_data->new_allocation = false;
     }
     if (extent->flat) {
         *cluster_offset = extent->flat_start_offset;
@@ -976,40 +1025,11 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    l2_table = extent->l2_cache + (min_index * extent->l2_size);
-    if (bdrv_pread(
-                extent->file,
-                (int64_t)l2_offset * 512,
-                l2_table,
-                extent->l2_size * sizeof(uint32_t)
-            ) != extent->l2_size * sizeof(uint32_t)) {
+    l2_table = vmdk_l2_cache_get(extent, l2_offset);
+    if (!l2_table) {
         return VMDK_ERROR;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
- found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
 
@@ -1054,6 +1074,7 @@ static int get_cluster_offset(BlockDriverState *bs,
 
         if (m_data) {
             m_data->offset = *cluster_offset;
+            m_data->new_allocation = true;
         }
     }
     *cluster_offset <<= 9;
@@ -1122,36 +1143,45 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
     return ret;
 }
 
-static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, const uint8_t *buf,
-                            int nb_sectors, int64_t sector_num)
+static int coroutine_fn vmdk_write_extent(VmdkExtent *extent,
+                                          int64_t cluster_offset,
+                                          int64_t offset_in_cluster,
+                                          QEMUIOVector *qiov,
+                                          int nb_sectors, int64_t sector_num)
 {
     int ret;
     VmdkGrainMarker *data = NULL;
+    uint8_t *buf = NULL;
     uLongf buf_len;
-    const uint8_t *write_buf = buf;
-    int write_len = nb_sectors * 512;
+    int write_len;
 
-    if (extent->compressed) {
-        if (!extent->has_marker) {
-            ret = -EINVAL;
-            goto out;
-        }
-        buf_len = (extent->cluster_sectors << 9) * 2;
-        data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
-        if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
-                buf_len == 0) {
-            ret = -EINVAL;
-            goto out;
-        }
-        data->lba = sector_num;
-        data->size = buf_len;
-        write_buf = (uint8_t *)data;
-        write_len = buf_len + sizeof(VmdkGrainMarker);
+    if (!extent->compressed) {
+        return bdrv_co_writev(extent->file,
+                              (cluster_offset + offset_in_cluster) >> 9,
+                              nb_sectors, qiov);
+    }
+
+    if (!extent->has_marker) {
+        ret = -EINVAL;
+        goto out;
     }
+    buf = g_malloc(nb_sectors << 9);
+    qemu_iovec_to_buf(qiov, 0, buf, nb_sectors << 9);
+
+    buf_len = (extent->cluster_sectors << 9) * 2;
+    data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
+    if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
+            buf_len == 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+    data->lba = sector_num;
+    data->size = buf_len;
+    write_len = buf_len + sizeof(VmdkGrainMarker);
+
     ret = bdrv_pwrite(extent->file,
                         cluster_offset + offset_in_cluster,
-                        write_buf,
+                        data,
                         write_len);
     if (ret != write_len) {
         ret = ret < 0 ? ret : -EIO;
@@ -1160,12 +1190,15 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     ret = 0;
  out:
     g_free(data);
+    g_free(buf);
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+static int coroutine_fn vmdk_read_extent(VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         QEMUIOVector *qiov,
+                                         int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
@@ -1177,14 +1210,9 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
 
 
     if (!extent->compressed) {
-        ret = bdrv_pread(extent->file,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
-            return -EIO;
-        }
+        return bdrv_co_readv(extent->file,
+                             (cluster_offset + offset_in_cluster) >> 9,
+                             nb_sectors, qiov);
     }
     cluster_bytes = extent->cluster_sectors * 512;
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
@@ -1220,7 +1248,8 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
+    qemu_iovec_from_buf(qiov, 0, uncomp_buf + offset_in_cluster,
+                        nb_sectors * 512);
     ret = 0;
 
  out:
@@ -1229,8 +1258,13 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * The metadata (L1/L2 tables, grain allocation, CID) is protected by s->lock,
+ * which is dropped while data is read from or written to allocated grains, so
+ * that requests to different grains run in parallel.
+ */
+static coroutine_fn int vmdk_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
@@ -1238,11 +1272,17 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
     uint64_t extent_begin_sector, extent_relative_sector_num;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
+    QEMUIOVector local_qiov;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto fail;
         }
         ret = get_cluster_offset(
                             bs, extent, NULL,
@@ -1254,58 +1294,68 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (n > nb_sectors) {
             n = nb_sectors;
         }
-        if (ret != VMDK_OK) {
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
+        if (ret == VMDK_ERROR) {
+            ret = -EIO;
+            goto fail;
+        } else if (ret != VMDK_OK) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd && ret != VMDK_ZEROED) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto fail;
                 }
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_co_mutex_unlock(&s->lock);
+                ret = bdrv_co_readv(bs->backing_hd, sector_num, n,
+                                    &local_qiov);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
-                    return ret;
+                    goto fail;
                 }
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(&local_qiov, 0, 0, n * 512);
             }
         } else {
+            qemu_co_mutex_unlock(&s->lock);
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
-                            buf, n);
+                            &local_qiov, n);
+            qemu_co_mutex_lock(&s->lock);
             if (ret) {
-                return ret;
+                goto fail;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
 /**
  * vmdk_write:
- * @zeroed:       buf is ignored (data is zero), use zeroed_grain GTE feature
+ * @zeroed:       qiov is ignored (data is zero), use zeroed_grain GTE feature
  *                if possible, otherwise return -ENOTSUP.
  * @zero_dry_run: used for zeroed == true only, don't update L2 table, just try
  *                with each cluster. By dry run we can find if the zero write
  *                is possible without modifying image data.
  *
+ * Must be called with s->lock held.  The lock is dropped while data is
+ * written to grains that were already allocated.
+ *
  * Returns: error code with 0 for success.
  */
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                      const uint8_t *buf, int nb_sectors,
-                      bool zeroed, bool zero_dry_run)
+static int coroutine_fn vmdk_write(BlockDriverState *bs, int64_t sector_num,
+                                   QEMUIOVector *qiov, int nb_sectors,
+                                   bool zeroed, bool zero_dry_run)
 {
     BDRVVmdkState *s = bs->opaque;
     VmdkExtent *extent = NULL;
@@ -1313,7 +1363,9 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
     int64_t index_in_cluster;
     uint64_t extent_begin_sector, extent_relative_sector_num;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
     VmdkMetaData m_data;
+    QEMUIOVector local_qiov;
 
     if (sector_num > bs->total_sectors) {
         error_report("Wrong offset: sector_num=0x%" PRIx64
@@ -1322,10 +1374,13 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
+    qemu_iovec_init(&local_qiov, qiov ? qiov->niov : 0);
+
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto out;
         }
         ret = get_cluster_offset(
                                 bs,
@@ -1338,7 +1393,8 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                 /* Refuse write to allocated cluster for streamOptimized */
                 error_report("Could not write to allocated cluster"
                               " for streamOptimized");
-                return -EIO;
+                ret = -EIO;
+                goto out;
             } else {
                 /* allocate */
                 ret = get_cluster_offset(
@@ -1350,7 +1406,8 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             }
         }
         if (ret == VMDK_ERROR) {
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
         }
         extent_begin_sector = extent->end_sector - extent->sectors;
         extent_relative_sector_num = sector_num - extent_begin_sector;
@@ -1360,7 +1417,7 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             n = nb_sectors;
         }
         if (zeroed) {
-            /* Do zeroed write, buf is ignored */
+            /* Do zeroed write, qiov is ignored */
             if (extent->has_zero_grain &&
                     index_in_cluster == 0 &&
                     n >= extent->cluster_sectors) {
@@ -1369,50 +1426,71 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                     m_data.offset = VMDK_GTE_ZEROED;
                     /* update L2 tables */
                     if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
-                        return -EIO;
+                        ret = -EIO;
+                        goto out;
                     }
                 }
             } else {
-                return -ENOTSUP;
+                ret = -ENOTSUP;
+                goto out;
             }
         } else {
-            ret = vmdk_write_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n, sector_num);
-            if (ret) {
-                return ret;
-            }
-            if (m_data.valid) {
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
+            if (m_data.valid && m_data.new_allocation) {
+                /* The L2 entry must only be written after the data, keep
+                 * the lock so that nobody sees the grain in between */
+                ret = vmdk_write_extent(extent,
+                                cluster_offset, index_in_cluster * 512,
+                                &local_qiov, n, sector_num);
+                if (ret) {
+                    goto out;
+                }
                 /* update L2 tables */
                 if (vmdk_L2update(extent, &m_data) != VMDK_OK) {
-                    return -EIO;
+                    ret = -EIO;
+                    goto out;
+                }
+            } else {
+                qemu_co_mutex_unlock(&s->lock);
+                ret = vmdk_write_extent(extent,
+                                cluster_offset, index_in_cluster * 512,
+                                &local_qiov, n, sector_num);
+                qemu_co_mutex_lock(&s->lock);
+                if (ret) {
+                    goto out;
                 }
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
 
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
             ret = vmdk_write_cid(bs, time(NULL));
             if (ret < 0) {
-                return ret;
+                goto out;
             }
             s->cid_updated = true;
         }
     }
-    return 0;
+    ret = 0;
+
+out:
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
 }
 
-static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
-                                      const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vmdk_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                       int nb_sectors, QEMUIOVector *qiov)
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
     qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+    ret = vmdk_write(bs, sector_num, qiov, nb_sectors, false, false);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1935,8 +2013,8 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_probe                   = vmdk_probe,
     .bdrv_open                    = vmdk_open,
     .bdrv_reopen_prepare          = vmdk_reopen_prepare,
-    .bdrv_read                    = vmdk_co_read,
-    .bdrv_write                   = vmdk_co_write,
+    .bdrv_co_readv                = vmdk_co_readv,
+    .bdrv_co_writev               = vmdk_co_writev,
     .bdrv_co_write_zeroes         = vmdk_co_write_zeroes,
     .bdrv_close                   = vmdk_close,
     .bdrv_create                  = vmdk_create,
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
+#include "qemu/bitmap.h"
 #include "migration/migration.h"
 #if defined(CONFIG_UUID)
 #include <uuid/uuid.h>
@@ -120,7 +121,10 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+
+    /* Blocks whose sector bitmap is known to have all sectors marked used,
+     * one bit per pagetable entry */
+    unsigned long *bitmap_full;
 
     uint32_t block_size;
     uint32_t bitmap_size;
@@ -276,7 +280,7 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags,
             goto fail;
         }
 
-        s->last_bitmap_offset = (int64_t) -1;
+        s->bitmap_full = bitmap_new(s->max_table_entries);
 
 #ifdef CACHE
         s->pageentry_u8 = g_malloc(512);
@@ -298,6 +302,7 @@ static int vpc_open(BlockDriverState *bs, QDict *options, int flags,
 
 fail:
     g_free(s->pagetable);
+    g_free(s->bitmap_full);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -313,12 +318,9 @@ static int vpc_reopen_prepare(BDRVReopenState *state,
 /*
  * Returns the absolute byte offset of the given sector in the image file.
  * If the sector is not allocated, -1 is returned instead.
- *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
  */
 static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+    int64_t sector_num)
 {
     BDRVVPCState *s = bs->opaque;
     uint64_t offset = sector_num * 512;
@@ -334,19 +336,6 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
     block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
-
-        s->last_bitmap_offset = bitmap_offset;
-        memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
-    }
-
 //    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
 //	sector_num, pagetable_index, pageentry_index,
 //	bitmap_offset, block_offset);
@@ -382,6 +371,57 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     return block_offset;
 }
 
+/*
+ * We must ensure that we don't write to any sectors which are marked as
+ * unused in the bitmap. We get away with setting all bits in the block
+ * bitmap the first time we write to a block. This might cause Virtual PC to
+ * miss sparse read optimization, but it's not a problem in terms of
+ * correctness.
+ *
+ * Blocks whose bitmap is known to be full are remembered, so the bitmap is
+ * looked at only once per block.  Must be called with s->lock held.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int coroutine_fn vpc_mark_block_used(BlockDriverState *bs,
+                                            int64_t sector_num)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint32_t index = (sector_num * 512) / s->block_size;
+    uint64_t bitmap_offset = 512 * (uint64_t) s->pagetable[index];
+    uint8_t *bitmap;
+    int i, ret;
+
+    if (test_bit(index, s->bitmap_full)) {
+        return 0;
+    }
+
+    bitmap = g_malloc(s->bitmap_size);
+    ret = bdrv_pread(bs->file, bitmap_offset, bitmap, s->bitmap_size);
+    if (ret < 0) {
+        goto out;
+    }
+    for (i = 0; i < s->bitmap_size; i++) {
+        if (bitmap[i] != 0xff) {
+            break;
+        }
+    }
+    if (i < s->bitmap_size) {
+        memset(bitmap, 0xff, s->bitmap_size);
+        ret = bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap,
+                               s->bitmap_size);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    set_bit(index, s->bitmap_full);
+    ret = 0;
+
+out:
+    g_free(bitmap);
+    return ret;
+}
+
 /*
  * Writes the footer to the end of the image file. This is needed when the
  * file grows as it overwrites the old footer
@@ -448,27 +488,39 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
     if (ret < 0)
         goto fail;
 
-    return get_sector_offset(bs, sector_num, 0);
+    set_bit(index, s->bitmap_full);
+    return get_sector_offset(bs, sector_num);
 
 fail:
     s->free_data_block_offset -= (s->block_size + s->bitmap_size);
     return -1;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * The BAT is kept in memory and only changes when a block is allocated, so
+ * s->lock is held just for the lookup and allocation; data is transferred
+ * without it, except for the first write to a new block.
+ */
+static coroutine_fn int vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int ret;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    QEMUIOVector local_qiov;
     VHDFooter *footer = (VHDFooter *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_read(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+        qemu_co_mutex_lock(&s->lock);
+        offset = get_sector_offset(bs, sector_num);
+        qemu_co_mutex_unlock(&s->lock);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -476,48 +528,50 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
             sectors = nb_sectors;
         }
 
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+
         if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_memset(&local_qiov, 0, 0, sectors * BDRV_SECTOR_SIZE);
         } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS, sectors,
+                                &local_qiov);
+            if (ret < 0) {
+                goto fail;
             }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
+fail:
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
     int64_t sectors, sectors_per_block;
+    uint64_t bytes_done = 0;
+    QEMUIOVector local_qiov;
     int ret;
     VHDFooter *footer =  (VHDFooter *) s->footer_buf;
 
     if (cpu_to_be32(footer->type) == VHD_FIXED) {
-        return bdrv_write(bs->file, sector_num, buf, nb_sectors);
+        return bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
     }
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_co_mutex_lock(&s->lock);
     while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
+        offset = get_sector_offset(bs, sector_num);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -525,33 +579,41 @@ static int vpc_write(BlockDriverState *bs, int64_t sector_num,
             sectors = nb_sectors;
         }
 
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done,
+                          sectors * BDRV_SECTOR_SIZE);
+
         if (offset == -1) {
             offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+            if (offset < 0) {
+                ret = -EIO;
+                goto fail;
+            }
+            ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                                 sectors, &local_qiov);
+        } else {
+            ret = vpc_mark_block_used(bs, sector_num);
+            if (ret < 0) {
+                goto fail;
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                                 sectors, &local_qiov);
+            qemu_co_mutex_lock(&s->lock);
         }
-
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        if (ret < 0) {
+            goto fail;
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
+    ret = 0;
 
-    return 0;
-}
-
-static coroutine_fn int vpc_co_write(BlockDriverState *bs, int64_t sector_num,
-                                     const uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_write(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
@@ -820,6 +882,7 @@ static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
     g_free(s->pagetable);
+    g_free(s->bitmap_full);
 #ifdef CACHE
     g_free(s->pageentry_u8);
 #endif
@@ -854,8 +917,8 @@ static BlockDriver bdrv_vpc = {
     .bdrv_reopen_prepare    = vpc_reopen_prepare,
     .bdrv_create            = vpc_create,
 
-    .bdrv_read              = vpc_co_read,
-    .bdrv_write             = vpc_co_write,
+    .bdrv_co_readv          = vpc_co_readv,
+    .bdrv_co_writev         = vpc_co_writev,
 
     .create_options         = vpc_create_options,
     .bdrv_has_zero_init     = vpc_has_zero_init,
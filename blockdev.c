@@ -289,6 +289,21 @@ static int parse_block_error_action(const char *buf, bool is_read, Error **errp)
     }
 }
 
+static BlockdevDetectZeroesOptions parse_detect_zeroes(const char *buf,
+                                                       Error **errp)
+{
+    int i;
+
+    for (i = 0; i < BLOCKDEV_DETECT_ZEROES_OPTIONS_MAX; i++) {
+        if (!strcmp(buf, BlockdevDetectZeroesOptions_lookup[i])) {
+            return i;
+        }
+    }
+
+    error_setg(errp, "invalid detect-zeroes option '%s'", buf);
+    return BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+}
+
 static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
 {
     if (throttle_conflicting(cfg)) {
@@ -322,6 +337,7 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     ThrottleConfig cfg;
     int snapshot = 0;
     bool copy_on_read;
+    BlockdevDetectZeroesOptions detect_zeroes;
     int ret;
     Error *error = NULL;
     QemuOpts *opts;
@@ -365,6 +381,21 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
         }
     }
 
+    detect_zeroes = BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
+    if ((buf = qemu_opt_get(opts, "detect-zeroes")) != NULL) {
+        detect_zeroes = parse_detect_zeroes(buf, &error);
+        if (error_is_set(&error)) {
+            error_propagate(errp, error);
+            goto early_err;
+        }
+        if (detect_zeroes == BLOCKDEV_DETECT_ZEROES_OPTIONS_UNMAP &&
+            !(bdrv_flags & BDRV_O_UNMAP)) {
+            error_setg(errp, "setting detect-zeroes to unmap is not allowed "
+                             "without setting discard operation to unmap");
+            goto early_err;
+        }
+    }
+
     if (qemu_opt_get_bool(opts, "cache.writeback", true)) {
         bdrv_flags |= BDRV_O_CACHE_WB;
     }
@@ -472,6 +503,10 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
     dinfo->bdrv = bdrv_new(dinfo->id);
     dinfo->bdrv->open_flags = snapshot ? BDRV_O_SNAPSHOT : 0;
     dinfo->bdrv->read_only = ro;
+    dinfo->bdrv->detect_zeroes = detect_zeroes;
+    dinfo->bdrv->cor_readahead =
+        qemu_opt_get_size(opts, "copy-on-read-readahead", 0)
+        >> BDRV_SECTOR_BITS;
     dinfo->type = type;
     dinfo->refcount = 1;
     if (serial != NULL) {
@@ -483,7 +518,8 @@ static DriveInfo *blockdev_init(QDict *bs_opts,
 
     /* disk I/O throttling */
     if (throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(dinfo->bdrv);
+        bdrv_io_limits_enable(dinfo->bdrv,
+                              qemu_opt_get(opts, "throttling.group"));
         bdrv_set_io_limits(dinfo->bdrv, &cfg);
     }
 
@@ -652,6 +688,8 @@ DriveInfo *drive_init(QemuOpts *all_opts, BlockInterfaceType block_default_type)
     qemu_opt_rename(all_opts,
                     "iops_size", "throttling.iops-size");
 
+    qemu_opt_rename(all_opts, "group", "throttling.group");
+
     qemu_opt_rename(all_opts, "readonly", "read-only");
 
     value = qemu_opt_get(all_opts, "cache");
@@ -1312,6 +1350,8 @@ static void drive_backup_prepare(BlkTransactionState *common, Error **errp)
                      backup->has_speed, backup->speed,
                      backup->has_on_source_error, backup->on_source_error,
                      backup->has_on_target_error, backup->on_target_error,
+                     backup->has_workers, backup->workers,
+                     backup->has_bitmap, backup->bitmap,
                      &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
@@ -1576,7 +1616,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_wr_max,
                                int64_t iops_wr_max,
                                bool has_iops_size,
-                               int64_t iops_size, Error **errp)
+                               int64_t iops_size,
+                               bool has_group,
+                               const char *group, Error **errp)
 {
     ThrottleConfig cfg;
     BlockDriverState *bs;
@@ -1624,9 +1666,11 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
     }
 
     if (!bs->io_limits_enabled && throttle_enabled(&cfg)) {
-        bdrv_io_limits_enable(bs);
+        bdrv_io_limits_enable(bs, has_group ? group : NULL);
     } else if (bs->io_limits_enabled && !throttle_enabled(&cfg)) {
         bdrv_io_limits_disable(bs);
+    } else if (bs->io_limits_enabled && has_group) {
+        bdrv_io_limits_update_group(bs, group);
     }
 
     if (bs->io_limits_enabled) {
@@ -1829,6 +1873,8 @@ void qmp_block_commit(const char *device,
     }
 }
 
+#define MAX_BACKUP_WORKERS 64
+
 void qmp_drive_backup(const char *device, const char *target,
                       bool has_format, const char *format,
                       enum MirrorSyncMode sync,
@@ -1836,10 +1882,13 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_workers, int64_t workers,
+                      bool has_bitmap, const char *bitmap,
                       Error **errp)
 {
     BlockDriverState *bs;
     BlockDriverState *target_bs;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
     BlockDriverState *source = NULL;
     BlockDriver *drv = NULL;
     Error *local_err = NULL;
@@ -1859,6 +1908,14 @@ void qmp_drive_backup(const char *device, const char *target,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_workers) {
+        workers = 1;
+    }
+    if (workers < 1 || workers > MAX_BACKUP_WORKERS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "workers",
+                  "a value between 1 and " stringify(MAX_BACKUP_WORKERS));
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1887,6 +1944,23 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
+    if (has_bitmap) {
+        if (sync != MIRROR_SYNC_MODE_FULL &&
+            sync != MIRROR_SYNC_MODE_INCREMENTAL) {
+            error_setg(errp, "A dirty bitmap can only be used with sync modes "
+                       "'full' and 'incremental'");
+            return;
+        }
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+    } else if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_MISSING_PARAMETER, "bitmap");
+        return;
+    }
+
     flags = bs->open_flags | BDRV_O_RDWR;
 
     /* See if we have a backing HD we can use to create our new image
@@ -1932,7 +2006,8 @@ void qmp_drive_backup(const char *device, const char *target,
         return;
     }
 
-    backup_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    backup_start(bs, target_bs, speed, sync, workers, sync_bitmap,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
@@ -1941,7 +2016,56 @@ void qmp_drive_backup(const char *device, const char *target,
     }
 }
 
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_file, const char *file,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    bdrv_create_dirty_bitmap(bs, name, has_granularity ? granularity : 0,
+                             has_file ? file : NULL, errp);
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return;
+    }
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Dirty bitmap '%s' is in use by a backup job", name);
+        return;
+    }
+
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
 #define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
+#define MAX_MIRROR_IN_FLIGHT      256
 
 void qmp_drive_mirror(const char *device, const char *target,
                       bool has_format, const char *format,
@@ -1950,6 +2074,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_granularity, uint32_t granularity,
                       bool has_buf_size, int64_t buf_size,
+                      bool has_max_in_flight, int64_t max_in_flight,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       Error **errp)
@@ -1980,6 +2105,15 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_buf_size) {
         buf_size = DEFAULT_MIRROR_BUF_SIZE;
     }
+    if (!has_max_in_flight) {
+        max_in_flight = 0;
+    }
+
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "sync",
+                  "'top', 'full' or 'none'");
+        return;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_set(errp, QERR_INVALID_PARAMETER, device);
@@ -1989,6 +2123,12 @@ void qmp_drive_mirror(const char *device, const char *target,
         error_set(errp, QERR_INVALID_PARAMETER, device);
         return;
     }
+    if (has_max_in_flight &&
+        (max_in_flight < 1 || max_in_flight > MAX_MIRROR_IN_FLIGHT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-in-flight",
+                  "a value between 1 and " stringify(MAX_MIRROR_IN_FLIGHT));
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -2067,7 +2207,8 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
-    mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
+    mirror_start(bs, target_bs, speed, granularity, buf_size, max_in_flight,
+                 sync,
                  on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
@@ -2247,6 +2388,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "discard",
             .type = QEMU_OPT_STRING,
             .help = "discard operation (ignore/off, unmap/on)",
+        },{
+            .name = "detect-zeroes",
+            .type = QEMU_OPT_STRING,
+            .help = "try to optimize zero writes (off, on, unmap)",
         },{
             .name = "cache.writeback",
             .type = QEMU_OPT_BOOL,
@@ -2335,10 +2480,18 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.iops-size",
             .type = QEMU_OPT_NUMBER,
             .help = "when limiting by iops max size of an I/O in bytes",
+        },{
+            .name = "throttling.group",
+            .type = QEMU_OPT_STRING,
+            .help = "name of the block throttling group",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "copy-on-read-readahead",
+            .type = QEMU_OPT_SIZE,
+            .help = "copy-on-read prefetch window for sequential reads",
         },
         { /* end of list */ }
     },
@@ -26,7 +26,8 @@
 
 #define VIRTIO_NET_VM_VERSION    11
 
-#define MAC_TABLE_ENTRIES    64
+#define MAC_HASH_BITS        10
+#define MAC_HASH_SIZE        (1 << MAC_HASH_BITS)
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
 /*
@@ -194,6 +195,49 @@ static void virtio_net_set_link_status(NetClientState *nc)
     virtio_net_set_status(vdev, vdev->status);
 }
 
+static unsigned mac_hash(const uint8_t *mac)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    int i;
+
+    for (i = 0; i < ETH_ALEN; i++) {
+        h = (h ^ mac[i]) * 16777619;
+    }
+    return (h ^ (h >> MAC_HASH_BITS)) & (MAC_HASH_SIZE - 1);
+}
+
+/* Must be called whenever the contents of n->mac_table change */
+static void virtio_net_mac_hash_rebuild(VirtIONet *n)
+{
+    int i;
+
+    memset(n->mac_table.hash_head, -1, MAC_HASH_SIZE * sizeof(int16_t));
+
+    /* Insert backwards so that chains are in table order */
+    for (i = n->mac_table.in_use - 1; i >= 0; i--) {
+        unsigned h = mac_hash(&n->mac_table.macs[i * ETH_ALEN]);
+
+        n->mac_table.hash_next[i] = n->mac_table.hash_head[h];
+        n->mac_table.hash_head[h] = i;
+    }
+}
+
+/* Looks up @mac among the entries [start, end) of the MAC filter table */
+static bool virtio_net_mac_lookup(VirtIONet *n, const uint8_t *mac,
+                                  int start, int end)
+{
+    int i;
+
+    for (i = n->mac_table.hash_head[mac_hash(mac)]; i >= 0;
+         i = n->mac_table.hash_next[i]) {
+        if (i >= start && i < end &&
+            !memcmp(mac, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void rxfilter_notify(NetClientState *nc)
 {
     QObject *event_data;
@@ -312,7 +356,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.first_multi = 0;
     n->mac_table.multi_overflow = 0;
     n->mac_table.uni_overflow = 0;
-    memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
+    memset(n->mac_table.macs, 0, n->net_conf.mac_table_entries * ETH_ALEN);
+    virtio_net_mac_hash_rebuild(n);
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
@@ -614,7 +659,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
     n->mac_table.first_multi = 0;
     n->mac_table.uni_overflow = 0;
     n->mac_table.multi_overflow = 0;
-    memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
+    memset(n->mac_table.macs, 0, n->net_conf.mac_table_entries * ETH_ALEN);
 
     s = iov_to_buf(iov, iov_cnt, 0, &mac_data.entries,
                    sizeof(mac_data.entries));
@@ -628,7 +673,7 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
         goto error;
     }
 
-    if (mac_data.entries <= MAC_TABLE_ENTRIES) {
+    if (mac_data.entries <= n->net_conf.mac_table_entries) {
         s = iov_to_buf(iov, iov_cnt, 0, n->mac_table.macs,
                        mac_data.entries * ETH_ALEN);
         if (s != mac_data.entries * ETH_ALEN) {
@@ -656,7 +701,8 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
         goto error;
     }
 
-    if (n->mac_table.in_use + mac_data.entries <= MAC_TABLE_ENTRIES) {
+    if (n->mac_table.in_use + mac_data.entries <=
+        n->net_conf.mac_table_entries) {
         s = iov_to_buf(iov, iov_cnt, 0,
                        &n->mac_table.macs[n->mac_table.in_use * ETH_ALEN],
                        mac_data.entries * ETH_ALEN);
@@ -668,11 +714,13 @@ static int virtio_net_handle_mac(VirtIONet *n, uint8_t cmd,
         n->mac_table.multi_overflow = 1;
     }
 
+    virtio_net_mac_hash_rebuild(n);
     rxfilter_notify(nc);
 
     return VIRTIO_NET_OK;
 
 error:
+    virtio_net_mac_hash_rebuild(n);
     rxfilter_notify(nc);
     return VIRTIO_NET_ERR;
 }
@@ -789,6 +837,11 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
+    /* With receive side steering, all packets arrive on the first queue */
+    if (n->rss) {
+        queue_index = 0;
+    }
+
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -887,7 +940,6 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     static const uint8_t bcast[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
     static const uint8_t vlan[] = {0x81, 0x00};
     uint8_t *ptr = (uint8_t *)buf;
-    int i;
 
     if (n->promisc)
         return 1;
@@ -909,10 +961,9 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         }
 
-        for (i = n->mac_table.first_multi; i < n->mac_table.in_use; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
+        if (virtio_net_mac_lookup(n, ptr, n->mac_table.first_multi,
+                                  n->mac_table.in_use)) {
+            return 1;
         }
     } else { // unicast
         if (n->nouni) {
@@ -923,16 +974,95 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
             return 1;
         }
 
-        for (i = 0; i < n->mac_table.first_multi; i++) {
-            if (!memcmp(ptr, &n->mac_table.macs[i * ETH_ALEN], ETH_ALEN)) {
-                return 1;
-            }
+        if (virtio_net_mac_lookup(n, ptr, 0, n->mac_table.first_multi)) {
+            return 1;
         }
     }
 
     return 0;
 }
 
+/*
+ * Receive side steering for backends with a single queue: the Toeplitz hash
+ * of the IP addresses (and TCP/UDP ports, unless the packet is a fragment)
+ * selects the RX queue, so that each flow stays on one queue.
+ */
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static uint32_t toeplitz_hash(const uint8_t *data, int len)
+{
+    uint32_t hash = 0;
+    uint32_t v = ldl_be_p(rss_key);
+    int i, b;
+
+    assert(len + 4 <= sizeof(rss_key));
+
+    for (i = 0; i < len; i++) {
+        for (b = 7; b >= 0; b--) {
+            if (data[i] & (1 << b)) {
+                hash ^= v;
+            }
+            v = (v << 1) | ((rss_key[i + 4] >> b) & 1);
+        }
+    }
+    return hash;
+}
+
+static VirtIONetQueue *virtio_net_rss_queue(VirtIONet *n, const uint8_t *buf,
+                                            size_t size)
+{
+    uint8_t tuple[36];
+    const uint8_t *l3, *l4;
+    size_t l3_len;
+    int tuple_len, proto;
+    uint16_t type;
+
+    if (size < n->host_hdr_len + 14) {
+        return &n->vqs[0];
+    }
+    buf += n->host_hdr_len;
+    size -= n->host_hdr_len;
+
+    type = lduw_be_p(buf + 12);
+    l3 = buf + 14;
+    if (type == 0x8100 && size >= 18) {
+        type = lduw_be_p(buf + 16);
+        l3 += 4;
+    }
+    l3_len = buf + size - l3;
+
+    if (type == 0x0800 && l3_len >= 20) {
+        int ihl = (l3[0] & 0xf) * 4;
+        bool fragment = lduw_be_p(l3 + 6) & 0x3fff;
+
+        memcpy(tuple, l3 + 12, 8);
+        tuple_len = 8;
+        proto = l3[9];
+        l4 = fragment || ihl < 20 ? NULL : l3 + ihl;
+    } else if (type == 0x86dd && l3_len >= 40) {
+        memcpy(tuple, l3 + 8, 32);
+        tuple_len = 32;
+        proto = l3[6];
+        l4 = l3 + 40;
+    } else {
+        return &n->vqs[0];
+    }
+
+    if (l4 && (proto == 6 || proto == 17) && /* TCP or UDP */
+        l4 + 4 <= buf + size) {
+        memcpy(tuple + tuple_len, l4, 4);
+        tuple_len += 4;
+    }
+
+    return &n->vqs[toeplitz_hash(tuple, tuple_len) % n->curr_queues];
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -947,6 +1077,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+    if (n->rss && n->curr_queues > 1) {
+        q = virtio_net_rss_queue(n, buf, size);
+        if (!virtio_queue_ready(q->rx_vq)) {
+            return -1;
+        }
+    }
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1028,11 +1165,35 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (nc->receive_batch) {
+        /* more packets are coming, notify once at the end */
+        q->rx_notify_pending = true;
+    } else {
+        virtio_notify(vdev, q->rx_vq);
+    }
 
     return size;
 }
 
+static void virtio_net_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    int i;
+
+    /*
+     * With RSS, the packets of the batch may have gone to any queue.  Check
+     * all of them in case the guest reduced curr_queues during the batch.
+     */
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify_pending) {
+            q->rx_notify_pending = false;
+            virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+        }
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1058,6 +1219,9 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtQueueElement elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc;
+    bool busy = false;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -1069,6 +1233,12 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
+    /* With receive side steering, only the first queue has a peer */
+    nc = qemu_get_subqueue(n->nic, n->rss ? 0 : queue_index);
+
+    /* Send the burst as one batch and notify the guest once at the end */
+    qemu_net_batch_begin(nc);
+
     while (virtqueue_pop(q->tx_vq, &elem)) {
         ssize_t ret, len;
         unsigned int out_num = elem.out_num;
@@ -1099,25 +1269,59 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
+        if (n->rss) {
+            /*
+             * Completions would not find the right queue, so don't wait
+             * for them: like other emulated NICs, let the packet be queued
+             * (or dropped) by the net layer.
+             */
+            ret = qemu_sendv_packet(nc, out_sg, out_num);
+        } else {
+            ret = qemu_sendv_packet_async(nc, out_sg, out_num,
+                                          virtio_net_tx_complete);
+        }
+        if (ret == 0 && !n->rss) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             q->async_tx.len  = len;
-            return -EBUSY;
+            busy = true;
+            break;
         }
 
         len += ret;
 
         virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
 
-        if (++num_packets >= n->tx_burst) {
+        if (++num_packets >= q->tx_burst) {
             break;
         }
     }
-    return num_packets;
+
+    qemu_net_batch_end(nc);
+
+    if (num_packets) {
+        virtio_notify(vdev, q->tx_vq);
+    }
+    return busy ? -EBUSY : num_packets;
+}
+
+/*
+ * The burst size follows the backlog: it doubles (up to TX_BURST_SCALE
+ * times x-txburst) while the guest keeps the ring full, so that fewer bottom
+ * halves and notification toggles are needed, and shrinks back to x-txburst
+ * when the guest is mostly idle.
+ */
+#define TX_BURST_SCALE 4
+
+static void virtio_net_tx_burst_update(VirtIONetQueue *q, int32_t sent)
+{
+    VirtIONet *n = q->n;
+
+    if (sent >= q->tx_burst) {
+        q->tx_burst = MIN(q->tx_burst * 2, n->tx_burst * TX_BURST_SCALE);
+    } else if (sent < q->tx_burst / 2) {
+        q->tx_burst = MAX(q->tx_burst / 2, n->tx_burst);
+    }
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
@@ -1202,12 +1406,15 @@ static void virtio_net_tx_bh(void *opaque)
 
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
-    if (ret >= n->tx_burst) {
+    if (ret >= q->tx_burst) {
+        virtio_net_tx_burst_update(q, ret);
         qemu_bh_schedule(q->tx_bh);
         q->tx_waiting = 1;
         return;
     }
 
+    virtio_net_tx_burst_update(q, ret);
+
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
@@ -1245,6 +1452,7 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
         }
 
         n->vqs[i].tx_waiting = 0;
+        n->vqs[i].tx_burst = n->tx_burst;
         n->vqs[i].n = n;
     }
 
@@ -1332,14 +1540,18 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
 
     if (version_id >= 5) {
         n->mac_table.in_use = qemu_get_be32(f);
-        /* MAC_TABLE_ENTRIES may be different from the saved image */
-        if (n->mac_table.in_use <= MAC_TABLE_ENTRIES) {
+        /* The table size may be different from the saved image */
+        if (n->mac_table.in_use <= n->net_conf.mac_table_entries) {
             qemu_get_buffer(f, n->mac_table.macs,
                             n->mac_table.in_use * ETH_ALEN);
         } else if (n->mac_table.in_use) {
-            uint8_t *buf = g_malloc0(n->mac_table.in_use);
-            qemu_get_buffer(f, buf, n->mac_table.in_use * ETH_ALEN);
-            g_free(buf);
+            int left = n->mac_table.in_use;
+            uint8_t buf[ETH_ALEN];
+
+            /* Skip the saved entries, we can't hold them */
+            while (left-- > 0) {
+                qemu_get_buffer(f, buf, ETH_ALEN);
+            }
             n->mac_table.multi_overflow = n->mac_table.uni_overflow = 1;
             n->mac_table.in_use = 0;
         }
@@ -1405,6 +1617,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
     n->mac_table.first_multi = i;
+    virtio_net_mac_hash_rebuild(n);
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
@@ -1431,6 +1644,7 @@ static NetClientInfo net_virtio_info = {
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
+    .batch_end = virtio_net_batch_end,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -1461,6 +1675,7 @@ void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features)
         }
     }
     n->config_size = config_size;
+    n->host_features = host_features;
 }
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -1494,9 +1709,43 @@ static int virtio_net_device_init(VirtIODevice *vdev)
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc;
 
+    /* Without VIRTIO_NET_F_MQ the guest only ever uses the first queue */
+    if (n->net_conf.rss_queues > 1 &&
+        !(n->host_features & (1 << VIRTIO_NET_F_MQ))) {
+        error_report("virtio-net: rss_queues requires mq=on");
+        return -1;
+    }
+
     virtio_init(VIRTIO_DEVICE(n), "virtio-net", VIRTIO_ID_NET,
                                   n->config_size);
 
+    if (n->net_conf.rss_queues > 1) {
+        NetClientState *peer = n->nic_conf.peers.ncs[0];
+        int max = (VIRTIO_PCI_QUEUE_MAX - 1) / 2;
+
+        if (n->nic_conf.queues > 1 ||
+            (peer && peer->info->type == NET_CLIENT_OPTIONS_KIND_TAP)) {
+            error_report("virtio-net: rss_queues is only supported for "
+                         "backends without multiqueue and tap support, "
+                         "ignoring it");
+        } else {
+            if (n->net_conf.rss_queues > max) {
+                error_report("virtio-net: rss_queues limited to %d", max);
+                n->net_conf.rss_queues = max;
+            }
+            /* The additional queues have no peer */
+            n->nic_conf.queues = n->net_conf.rss_queues;
+            n->rss = true;
+        }
+    }
+
+    /* The hash chains use 16-bit indices */
+    if (n->net_conf.mac_table_entries > INT16_MAX) {
+        error_report("virtio-net: mac_table_entries limited to %d",
+                     INT16_MAX);
+        n->net_conf.mac_table_entries = INT16_MAX;
+    }
+
     n->max_queues = MAX(n->nic_conf.queues, 1);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
@@ -1552,10 +1801,14 @@ static int virtio_net_device_init(VirtIODevice *vdev)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
+    n->vqs[0].tx_burst = n->tx_burst;
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
-    n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
+    n->mac_table.macs = g_malloc0(n->net_conf.mac_table_entries * ETH_ALEN);
+    n->mac_table.hash_head = g_new(int16_t, MAC_HASH_SIZE);
+    n->mac_table.hash_next = g_new(int16_t, n->net_conf.mac_table_entries);
+    virtio_net_mac_hash_rebuild(n);
 
     n->vlans = g_malloc0(MAX_VLAN >> 3);
 
@@ -1591,6 +1844,8 @@ static int virtio_net_device_exit(DeviceState *qdev)
     }
 
     g_free(n->mac_table.macs);
+    g_free(n->mac_table.hash_head);
+    g_free(n->mac_table.hash_next);
     g_free(n->vlans);
 
     for (i = 0; i < n->max_queues; i++) {
@@ -1631,6 +1886,9 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT16("rss_queues", VirtIONet, net_conf.rss_queues, 0),
+    DEFINE_PROP_UINT32("mac_table_entries", VirtIONet,
+                       net_conf.mac_table_entries, MAC_TABLE_ENTRIES),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1367,6 +1367,15 @@ static QEMUMachine spapr_machine = {
     .max_cpus = MAX_CPUS,
     .no_parallel = 1,
     .default_boot_order = NULL,
+    .compat_props = (GlobalProperty[]) {
+        /* Not versioned yet, so keep the virtio-net guest ABI of 1.6 */
+        {
+            .driver   = "virtio-net-pci",
+            .property = "mac_table_entries",
+            .value    = stringify(64),
+        },
+        { /* end of list */ }
+    },
 };
 
 static void spapr_machine_init(void)
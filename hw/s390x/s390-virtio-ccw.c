@@ -141,6 +141,15 @@ static QEMUMachine ccw_machine = {
     .no_sdcard = 1,
     .use_sclp = 1,
     .max_cpus = 255,
+    .compat_props = (GlobalProperty[]) {
+        /* Not versioned yet, so keep the virtio-net guest ABI of 1.6 */
+        {
+            .driver   = TYPE_VIRTIO_NET_CCW,
+            .property = "mac_table_entries",
+            .value    = stringify(64),
+        },
+        { /* end of list */ }
+    },
 };
 
 static void ccw_machine_init(void)
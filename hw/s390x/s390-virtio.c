@@ -293,6 +293,15 @@ static QEMUMachine s390_machine = {
     .use_virtcon = 1,
     .max_cpus = 255,
     .is_default = 1,
+    .compat_props = (GlobalProperty[]) {
+        /* Not versioned yet, so keep the virtio-net guest ABI of 1.6 */
+        {
+            .driver   = TYPE_VIRTIO_NET_S390,
+            .property = "mac_table_entries",
+            .value    = stringify(64),
+        },
+        { /* end of list */ }
+    },
 };
 
 static void s390_machine_init(void)
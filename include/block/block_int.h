@@ -37,9 +37,12 @@
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
 
+typedef struct ThrottleGroup ThrottleGroup;
+
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTENDED_L2      16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -52,6 +55,7 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTENDED_L2       "extended_l2"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 
 typedef struct BdrvTrackedRequest {
@@ -272,8 +276,19 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* I/O throttling */
-    ThrottleState throttle_state;
+    /* copy-on-read readahead: once the guest reads sequentially, the
+     * sectors [cor_ra_pos, cor_ra_end) are prefetched in the background */
+    int64_t cor_readahead;      /* window in sectors, 0 if disabled */
+    int64_t cor_ra_next;        /* sector following the last request */
+    int cor_ra_streak;          /* number of sequential requests seen */
+    int64_t cor_ra_pos;
+    int64_t cor_ra_end;
+    bool cor_ra_running;
+
+    /* I/O throttling: the limits are kept in a group that may be shared
+     * with other devices, see block/throttle-groups.c */
+    ThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) round_robin;
     CoQueue      throttled_reqs[2];
     bool         io_limits_enabled;
 
@@ -295,6 +310,9 @@ struct BlockDriverState {
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
+    /* turn writes of all-zero data into (possibly unmapping) zero writes */
+    BlockdevDetectZeroesOptions detect_zeroes;
+
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     BlockdevOnError on_read_error, on_write_error;
@@ -302,6 +320,7 @@ struct BlockDriverState {
     BlockDeviceIoStatus iostatus;
     char device_name[32];
     HBitmap *dirty_bitmap;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int refcnt;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
@@ -390,6 +409,8 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
+ * @max_in_flight: The maximum number of concurrent requests, or 0 for
+ * the default.  The job adapts the actual number to the observed latency.
  * @mode: Whether to collapse all images in the chain to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
@@ -404,6 +425,7 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
+                  int max_in_flight,
                   MirrorSyncMode mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
@@ -415,6 +437,10 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
+ * @workers: Number of clusters copied in parallel by the background job.
+ * @sync_bitmap: Named dirty bitmap to base the backup on, or NULL.  Required
+ *               for MIRROR_SYNC_MODE_INCREMENTAL.  The bitmap starts a new
+ *               increment, unless the job fails or is cancelled.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -424,7 +450,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * until the job is cancelled or manually completed.
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, MirrorSyncMode sync_mode,
+                  int64_t speed, MirrorSyncMode sync_mode, int workers,
+                  BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
@@ -61,6 +61,13 @@ enum {
 /* Maximum size of a single READ/WRITE data buffer */
 #define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
 
+/* Maximum size of the data buffers of all requests from one client */
+#define NBD_MAX_BUFFERED_BYTES (4 * NBD_MAX_BUFFER_SIZE)
+
+/* Requests a single client may have in flight (default and upper limit) */
+#define NBD_DEFAULT_MAX_REQUESTS    64
+#define NBD_MAX_REQUESTS_LIMIT      1024
+
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_incoming(const char *address, uint16_t port);
 int tcp_socket_incoming_spec(const char *address_and_port);
@@ -82,6 +89,8 @@ typedef struct NBDClient NBDClient;
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
                           off_t size, uint32_t nbdflags,
                           void (*close)(NBDExport *));
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests);
+void nbd_export_set_sparse_reads(NBDExport *exp, bool enable);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
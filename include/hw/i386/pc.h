@@ -268,6 +268,10 @@ int e820_add_entry(uint64_t, uint64_t, uint32_t);
             .driver   = "q35-pcihost",\
             .property = "short_root_bus",\
             .value    = stringify(1),\
+        },{\
+            .driver   = "virtio-net-pci",\
+            .property = "mac_table_entries",\
+            .value    = stringify(64),\
         }
 
 #define PC_COMPAT_1_5 \
@@ -65,11 +65,17 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Default size of the MAC filter table.  Machine types before 1.7 use 64,
+ * the table is part of the migration stream. */
+#define MAC_TABLE_ENTRIES 512
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint16_t rss_queues;
+    uint32_t mac_table_entries;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -147,6 +153,8 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     int tx_waiting;
+    int32_t tx_burst;           /* current burst size, see x-txburst */
+    bool rx_notify_pending;
     struct {
         VirtQueueElement elem;
         ssize_t len;
@@ -181,6 +189,8 @@ typedef struct VirtIONet {
         uint8_t multi_overflow;
         uint8_t uni_overflow;
         uint8_t *macs;
+        int16_t *hash_head;     /* first entry of each hash chain, or -1 */
+        int16_t *hash_next;     /* next entry in the same chain, or -1 */
     } mac_table;
     uint32_t *vlans;
     virtio_net_conf net_conf;
@@ -189,7 +199,9 @@ typedef struct VirtIONet {
     int multiqueue;
     uint16_t max_queues;
     uint16_t curr_queues;
+    bool rss;
     size_t config_size;
+    uint32_t host_features;
     char *netclient_name;
     char *netclient_type;
     uint64_t curr_guest_offloads;
@@ -268,7 +280,10 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                               \
+    DEFINE_PROP_UINT16("rss_queues", _state, _field.rss_queues, 0),         \
+    DEFINE_PROP_UINT32("mac_table_entries", _state, _field.mac_table_entries, \
+                       MAC_TABLE_ENTRIES)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -346,6 +346,7 @@ size_t qemu_iovec_from_buf(QEMUIOVector *qiov, size_t offset,
                            const void *buf, size_t bytes);
 size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
                          int fillc, size_t bytes);
+bool qemu_iovec_is_zero(QEMUIOVector *qiov);
 
 bool buffer_is_zero(const void *buf, size_t len);
 
@@ -87,6 +87,7 @@ struct NBDRequest {
     QSIMPLEQ_ENTRY(NBDRequest) entry;
     NBDClient *client;
     uint8_t *data;
+    uint32_t data_len;
 };
 
 struct NBDExport {
@@ -98,6 +99,8 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;
+    bool sparse_reads;
     QTAILQ_HEAD(, NBDClient) clients;
     QTAILQ_ENTRY(NBDExport) next;
 };
@@ -119,6 +122,11 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    /* Data buffers of the requests in flight, and the receiver that
+     * waits until the next one fits under NBD_MAX_BUFFERED_BYTES */
+    size_t buffered_bytes;
+    CoQueue buffer_queue;
 };
 
 /* That's all folks */
@@ -769,11 +777,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -782,23 +787,8 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
-
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -846,7 +836,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= client->exp->max_requests - 1);
     client->nb_requests++;
 
     req = g_slice_new0(NBDRequest);
@@ -855,16 +845,20 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     return req;
 }
 
-static void nbd_request_put(NBDRequest *req)
+static void coroutine_fn nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
 
     if (req->data) {
         qemu_vfree(req->data);
+        client->buffered_bytes -= req->data_len;
+        if (qemu_co_queue_next(&client->buffer_queue)) {
+            qemu_notify_event();
+        }
     }
     g_slice_free(NBDRequest, req);
 
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    if (client->nb_requests-- == client->exp->max_requests) {
         qemu_notify_event();
     }
     nbd_client_put(client);
@@ -880,6 +874,7 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->bs = bs;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = NBD_DEFAULT_MAX_REQUESTS;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
     exp->close = close;
     bdrv_ref(bs);
@@ -919,6 +914,21 @@ void nbd_export_set_name(NBDExport *exp, const char *name)
     nbd_export_put(exp);
 }
 
+/* Set how many requests each client may have in flight at the same time.
+ * Only affects clients that connect afterwards.  */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests >= 1 && max_requests <= NBD_MAX_REQUESTS_LIMIT);
+    exp->max_requests = max_requests;
+}
+
+/* With sparse reads enabled, ranges that the image reports as zero are not
+ * read from the image but filled in directly.  */
+void nbd_export_set_sparse_reads(NBDExport *exp, bool enable)
+{
+    exp->sparse_reads = enable;
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
@@ -982,25 +992,31 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
 {
     NBDClient *client = req->client;
     int csock = client->sock;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
     ssize_t rc, ret;
 
+    nbd_encode_reply(buf, reply);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = req->data;
+    iov[1].iov_len = len;
+
     qemu_co_mutex_lock(&client->send_lock);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
                          nbd_restart_write, client);
     client->send_coroutine = qemu_coroutine_self();
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
+    /* Header and payload go out with a single sendmsg() in the common case,
+     * so neither corking nor a second system call is needed.
+     */
+    TRACE("Sending response to client");
+    ret = qemu_co_sendv(csock, iov, len ? 2 : 1, 0, sizeof(buf) + len);
+    if (ret != sizeof(buf) + len) {
+        LOG("writing to socket failed");
+        rc = ret < 0 ? ret : -EIO;
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        rc = 0;
     }
 
     client->send_coroutine = NULL;
@@ -1043,7 +1059,16 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
+        /* Stop reading from the socket until enough buffers are freed */
+        client->recv_coroutine = NULL;
+        while (client->buffered_bytes + request->len > NBD_MAX_BUFFERED_BYTES) {
+            qemu_co_queue_wait(&client->buffer_queue);
+        }
+        client->recv_coroutine = qemu_coroutine_self();
+
         req->data = qemu_blockalign(client->exp->bs, request->len);
+        req->data_len = request->len;
+        client->buffered_bytes += request->len;
     }
     if (command == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
@@ -1061,6 +1086,51 @@ out:
     return rc;
 }
 
+static int coroutine_fn nbd_co_read(NBDExport *exp, uint8_t *buf,
+                                    int64_t sector_num, int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t ret;
+    int n;
+
+    if (!exp->sparse_reads) {
+        iov.iov_base = buf;
+        iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        return bdrv_co_readv(exp->bs, sector_num, nb_sectors, &qiov);
+    }
+
+    while (nb_sectors > 0) {
+        ret = bdrv_get_block_status(exp->bs, sector_num, nb_sectors, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        if (n == 0) {
+            /* Past the end of the image */
+            n = nb_sectors;
+            ret = BDRV_BLOCK_ZERO;
+        }
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        if (ret & BDRV_BLOCK_ZERO) {
+            memset(buf, 0, iov.iov_len);
+        } else {
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_readv(exp->bs, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        buf += iov.iov_len;
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
 static void nbd_trip(void *opaque)
 {
     NBDClient *client = opaque;
@@ -1114,8 +1184,9 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+        ret = nbd_co_read(exp, req->data,
+                          (request.from + exp->dev_offset) / 512,
+                          request.len / 512);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1212,7 +1283,11 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    if (!qemu_co_queue_empty(&client->buffer_queue)) {
+        return 0;
+    }
+    return client->recv_coroutine ||
+           client->nb_requests < client->exp->max_requests;
 }
 
 static void nbd_read(void *opaque)
@@ -1247,6 +1322,7 @@ NBDClient *nbd_client_new(NBDExport *exp, int csock,
     }
     client->close = close;
     qemu_co_mutex_init(&client->send_lock);
+    qemu_co_queue_init(&client->buffer_queue);
     qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
 
     if (exp) {
@@ -0,0 +1,489 @@
+/*
+ * QEMU packet socket backend with memory-mapped rings (TPACKET_V3)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "config-host.h"
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "util.h"
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+
+#define AF_PACKET_BLOCK_SIZE    (1 << 20)
+#define AF_PACKET_BLOCKS        8
+#define AF_PACKET_TIMEOUT       1
+#define AF_PACKET_FRAMES        256
+
+#define VLAN_HLEN               4
+
+/* Frames are received in place; this only sets the ring's frame count */
+#define AF_PACKET_RX_FRAME_SIZE 2048
+
+/* Without PACKET_TX_HAS_OFF, the kernel expects the frame at this offset */
+#define AF_PACKET_TX_DATA_OFFSET \
+    (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+/*
+ * The receive ring is made of blocks that the kernel fills with frames and
+ * hands over as a whole, when they are full or after the block timeout.  One
+ * wakeup thus delivers many frames, without a syscall per frame.
+ *
+ * The transmit ring is made of fixed-size frames.  Frames are filled while a
+ * batch is in progress and the kernel is kicked once at the end of the batch.
+ * Kernels without TPACKET_V3 transmit rings (before Linux 4.11) fall back to
+ * one write per frame.
+ */
+typedef struct AfPacketState {
+    NetClientState nc;
+    int fd;
+    int mtu;
+    uint64_t tx_dropped;        /* frames too large for the interface */
+    uint8_t *map;
+    size_t map_size;
+
+    uint8_t *rx_ring;
+    unsigned int rx_block_size;
+    unsigned int rx_blocks;
+    unsigned int rx_block;      /* block being delivered */
+    unsigned int rx_pkt;        /* frames of that block already delivered */
+    unsigned int rx_offset;     /* offset of the next frame in that block */
+
+    uint8_t *tx_ring;
+    unsigned int tx_frame_size;
+    unsigned int tx_frames;
+    unsigned int tx_head;       /* next frame to fill */
+    unsigned int tx_pending;    /* frames filled since the last kick */
+
+    bool read_poll;
+    bool write_poll;
+} AfPacketState;
+
+static int af_packet_can_send(void *opaque);
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_update_fd_handler(AfPacketState *s)
+{
+    qemu_set_fd_handler2(s->fd,
+                         s->read_poll  ? af_packet_can_send : NULL,
+                         s->read_poll  ? af_packet_send     : NULL,
+                         s->write_poll ? af_packet_writable : NULL,
+                         s);
+}
+
+static void af_packet_read_poll(AfPacketState *s, bool enable)
+{
+    s->read_poll = enable;
+    af_packet_update_fd_handler(s);
+}
+
+static void af_packet_write_poll(AfPacketState *s, bool enable)
+{
+    s->write_poll = enable;
+    af_packet_update_fd_handler(s);
+}
+
+/* Asks the kernel to transmit all frames marked TP_STATUS_SEND_REQUEST */
+static void af_packet_kick(AfPacketState *s)
+{
+    ssize_t ret;
+
+    if (!s->tx_pending) {
+        return;
+    }
+
+    do {
+        ret = send(s->fd, NULL, 0, MSG_DONTWAIT);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1 && (errno == EAGAIN || errno == ENOBUFS)) {
+        /* The frames stay in the ring, try again when the socket is ready */
+        af_packet_write_poll(s, true);
+        return;
+    }
+    s->tx_pending = 0;
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+    af_packet_kick(s);
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_packet_write_packet(AfPacketState *s,
+                                      const struct iovec *iov, int iovcnt)
+{
+    ssize_t len;
+
+    do {
+        len = writev(s->fd, iov, iovcnt);
+    } while (len == -1 && errno == EINTR);
+
+    if (len == -1 && errno == EAGAIN) {
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+
+    return len;
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    struct tpacket3_hdr *hdr;
+    size_t size = iov_size(iov, iovcnt);
+
+    if (size > net_max_frame_len(iov, iovcnt, s->mtu)) {
+        /* The kernel would refuse it, and it would not fit in the ring */
+        s->tx_dropped++;
+        return size;
+    }
+
+    if (!s->tx_ring) {
+        return af_packet_write_packet(s, iov, iovcnt);
+    }
+
+    hdr = (struct tpacket3_hdr *)(s->tx_ring +
+                                  s->tx_head * s->tx_frame_size);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        /* Ring full, queue the packet until the kernel has sent some */
+        af_packet_kick(s);
+        af_packet_write_poll(s, true);
+        return 0;
+    }
+    smp_rmb();
+
+    iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET,
+               size);
+    hdr->tp_len = size;
+    hdr->tp_next_offset = 0;
+    smp_wmb();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    s->tx_head = (s->tx_head + 1) % s->tx_frames;
+    s->tx_pending++;
+
+    /* Outside of a batch, or if the batch fills half the ring, kick now */
+    if (!nc->receive_batch || s->tx_pending >= s->tx_frames / 2) {
+        af_packet_kick(s);
+    }
+
+    return size;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc, const uint8_t *buf,
+                                 size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static void af_packet_batch_end(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_kick(s);
+}
+
+static int af_packet_can_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+/*
+ * Delivers the frames of all blocks that the kernel has handed over, as one
+ * batch, and returns each block to the kernel once all of its frames are
+ * delivered.  Only one pass over the ring is made per wakeup, so that a busy
+ * interface cannot starve the main loop.
+ */
+static void af_packet_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+    unsigned int blocks = 0;
+
+    qemu_net_batch_begin(&s->nc);
+
+    while (blocks++ < s->rx_blocks) {
+        struct tpacket_block_desc *desc;
+
+        desc = (struct tpacket_block_desc *)(s->rx_ring +
+                                             s->rx_block * s->rx_block_size);
+        if (!(desc->hdr.bh1.block_status & TP_STATUS_USER)) {
+            break;
+        }
+        smp_rmb();
+
+        if (s->rx_pkt == 0) {
+            s->rx_offset = desc->hdr.bh1.offset_to_first_pkt;
+        }
+
+        while (s->rx_pkt < desc->hdr.bh1.num_pkts) {
+            struct tpacket3_hdr *hdr;
+            ssize_t size;
+
+            hdr = (struct tpacket3_hdr *)((uint8_t *)desc + s->rx_offset);
+            s->rx_offset += hdr->tp_next_offset;
+            s->rx_pkt++;
+
+            size = qemu_send_packet_async(&s->nc, (uint8_t *)hdr + hdr->tp_mac,
+                                          hdr->tp_snaplen,
+                                          af_packet_send_completed);
+            if (size == 0) {
+                /* The frame was queued, resume after it once it is sent */
+                af_packet_read_poll(s, false);
+                goto out;
+            }
+        }
+
+        smp_mb();
+        desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        s->rx_block = (s->rx_block + 1) % s->rx_blocks;
+        s->rx_pkt = 0;
+
+        if (!qemu_can_send_packet(&s->nc)) {
+            break;
+        }
+    }
+
+out:
+    qemu_net_batch_end(&s->nc);
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    af_packet_read_poll(s, false);
+    af_packet_write_poll(s, false);
+    munmap(s->map, s->map_size);
+    close(s->fd);
+
+    if (s->tx_dropped) {
+        qemu_log("-netdev af-packet: %" PRIu64 " oversized frames dropped\n",
+                 s->tx_dropped);
+    }
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AfPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .batch_end = af_packet_batch_end,
+    .cleanup = af_packet_cleanup,
+};
+
+static int af_packet_get_mtu(int fd, const char *ifname)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    if (ioctl(fd, SIOCGIFMTU, &ifr) < 0) {
+        return -1;
+    }
+
+    return ifr.ifr_mtu;
+}
+
+static int net_af_packet_init(NetClientState *peer, const char *model,
+                              const char *name, const char *ifname,
+                              uint64_t block_size, unsigned int blocks,
+                              unsigned int timeout, unsigned int frames)
+{
+    NetClientState *nc;
+    AfPacketState *s;
+    struct tpacket_req3 rx_req, tx_req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    int fd, ifindex, mtu, ver = TPACKET_V3, loss = 1;
+    size_t page_size = getpagesize();
+    size_t rx_size, tx_size = 0;
+    uint8_t *map;
+
+    if (block_size < page_size || block_size % page_size ||
+        block_size > UINT32_MAX) {
+        error_report("af-packet: block-size must be a multiple of %zu",
+                     page_size);
+        return -1;
+    }
+    if (!blocks || !frames) {
+        error_report("af-packet: blocks and frames must be non-zero");
+        return -1;
+    }
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        error_report("af-packet: unknown interface '%s'", ifname);
+        return -1;
+    }
+
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        error_report("af-packet: socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0) {
+        error_report("af-packet: TPACKET_V3 not supported: %s",
+                     strerror(errno));
+        goto fail;
+    }
+
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size = block_size;
+    rx_req.tp_block_nr = blocks;
+    rx_req.tp_frame_size = AF_PACKET_RX_FRAME_SIZE;
+    rx_req.tp_frame_nr = block_size / AF_PACKET_RX_FRAME_SIZE * blocks;
+    rx_req.tp_retire_blk_tov = timeout;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING,
+                   &rx_req, sizeof(rx_req)) < 0) {
+        error_report("af-packet: cannot set up receive ring: %s",
+                     strerror(errno));
+        goto fail;
+    }
+    rx_size = block_size * blocks;
+
+    mtu = af_packet_get_mtu(fd, ifname);
+    if (mtu < 0) {
+        error_report("af-packet: cannot get MTU of '%s': %s", ifname,
+                     strerror(errno));
+        goto fail;
+    }
+
+    /* One frame per block, large enough for a VLAN-tagged frame */
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = ROUND_UP(AF_PACKET_TX_DATA_OFFSET +
+                                    ETH_HLEN + VLAN_HLEN + mtu,
+                                    page_size);
+    tx_req.tp_block_nr = frames;
+    tx_req.tp_frame_size = tx_req.tp_block_size;
+    tx_req.tp_frame_nr = frames;
+
+    /*
+     * Without PACKET_LOSS, a frame that the kernel refuses (e.g. because the
+     * MTU was lowered) is left in the ring and stops transmission for good.
+     */
+    if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) == 0 &&
+        setsockopt(fd, SOL_PACKET, PACKET_TX_RING,
+                   &tx_req, sizeof(tx_req)) == 0) {
+        tx_size = (size_t)tx_req.tp_block_size * frames;
+    }
+
+    map = mmap(NULL, rx_size + tx_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (map == MAP_FAILED) {
+        /* MAP_LOCKED may exceed RLIMIT_MEMLOCK, it is only an optimization */
+        map = mmap(NULL, rx_size + tx_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        error_report("af-packet: cannot map rings: %s", strerror(errno));
+        goto fail;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_report("af-packet: cannot bind to '%s': %s", ifname,
+                     strerror(errno));
+        goto fail_unmap;
+    }
+
+    /* The guest has its own MAC address */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_report("af-packet: cannot set '%s' promiscuous: %s", ifname,
+                     strerror(errno));
+        goto fail_unmap;
+    }
+
+    qemu_set_nonblock(fd);
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, model, name);
+
+    snprintf(nc->info_str, sizeof(nc->info_str),
+             "ifname=%s,blocks=%u,frames=%u%s", ifname, blocks, frames,
+             tx_size ? "" : ",tx_ring=off");
+
+    s = DO_UPCAST(AfPacketState, nc, nc);
+    s->fd = fd;
+    s->mtu = mtu;
+    s->map = map;
+    s->map_size = rx_size + tx_size;
+    s->rx_ring = map;
+    s->rx_block_size = block_size;
+    s->rx_blocks = blocks;
+    if (tx_size) {
+        s->tx_ring = map + rx_size;
+        s->tx_frame_size = tx_req.tp_frame_size;
+        s->tx_frames = frames;
+    }
+
+    af_packet_read_poll(s, true);
+
+    return 0;
+
+fail_unmap:
+    munmap(map, rx_size + tx_size);
+fail:
+    close(fd);
+    return -1;
+}
+
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer)
+{
+    const NetdevAfPacketOptions *af_packet;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_AF_PACKET);
+    af_packet = opts->af_packet;
+
+    return net_af_packet_init(peer, "af-packet", name, af_packet->ifname,
+        af_packet->has_block_size ? af_packet->block_size
+                                  : AF_PACKET_BLOCK_SIZE,
+        af_packet->has_blocks ? af_packet->blocks : AF_PACKET_BLOCKS,
+        af_packet->has_timeout ? af_packet->timeout : AF_PACKET_TIMEOUT,
+        af_packet->has_frames ? af_packet->frames : AF_PACKET_FRAMES);
+}
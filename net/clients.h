@@ -52,4 +52,9 @@ int net_init_vde(const NetClientOptions *opts, const char *name,
                  NetClientState *peer);
 #endif
 
+#ifdef CONFIG_AF_PACKET
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer);
+#endif
+
 #endif /* QEMU_NET_CLIENTS_H */
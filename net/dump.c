@@ -21,22 +21,71 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-
 #include "clients.h"
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "hub.h"
 
+/*
+ * Records are appended to an in-memory buffer on the caller's thread and
+ * written to disk by a worker thread, so that the net path never waits for
+ * disk I/O.  Partially filled buffers are handed over after DUMP_FLUSH_MS.
+ * If the disk cannot keep up and DUMP_MAX_QUEUED buffers are waiting, new
+ * packets are dropped from the dump (and counted) rather than stalling the
+ * guest.
+ *
+ * With file-size, the dump rotates over files named <file>.0 ... <file>.N-1,
+ * each of which is a complete pcap file of at most file-size bytes.
+ */
+#define DUMP_BUF_SIZE   (256 * 1024)
+#define DUMP_MAX_QUEUED 64
+#define DUMP_FLUSH_MS   1000
+
+typedef struct DumpBuffer {
+    uint8_t *data;
+    size_t len;
+    int file;                   /* if >= 0, switch to this file first */
+    QSIMPLEQ_ENTRY(DumpBuffer) next;
+} DumpBuffer;
+
 typedef struct DumpState {
     NetClientState nc;
     int64_t start_ts;
-    int fd;
     int pcap_caplen;
+    bool nsec;
+    char *filename;
+    unsigned int files;         /* 0 if the dump does not rotate */
+    uint64_t file_size;
+
+    /* Used by the caller's thread only */
+    unsigned int cur_file;
+    uint64_t cur_size;
+    DumpBuffer *buf;
+    size_t buf_size;
+    QEMUTimer *flush_timer;
+    uint64_t dropped;
+    bool failed;
+
+    /* Shared with the worker thread, protected by lock */
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, DumpBuffer) queue;
+    QSIMPLEQ_HEAD(, DumpBuffer) free_bufs;
+    unsigned int queued;
+    bool error;
+    bool stop;
+
+    /* Used by the worker thread only, once it is started */
+    QemuThread thread;
+    int fd;
 } DumpState;
 
-#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
 
 struct pcap_file_hdr {
     uint32_t magic;
@@ -51,46 +100,241 @@ struct pcap_file_hdr {
 struct pcap_sf_pkthdr {
     struct {
         int32_t tv_sec;
-        int32_t tv_usec;
+        int32_t tv_frac;        /* usec, or nsec with PCAP_MAGIC_NSEC */
     } ts;
     uint32_t caplen;
     uint32_t len;
 };
 
+static char *dump_file_name(const char *filename, unsigned int files,
+                            unsigned int index)
+{
+    if (!files) {
+        return g_strdup(filename);
+    }
+    return g_strdup_printf("%s.%u", filename, index);
+}
+
+/* Creates a dump file and writes the pcap header, returns the fd or -1 */
+static int dump_open(const char *filename, int caplen, bool nsec)
+{
+    struct pcap_file_hdr hdr;
+    int fd;
+
+    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    hdr.magic = nsec ? PCAP_MAGIC_NSEC : PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = caplen;
+    hdr.linktype = 1;
+
+    if (qemu_write_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    DumpBuffer *buf;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&s->queue) && !s->stop) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        buf = QSIMPLEQ_FIRST(&s->queue);
+        if (!buf) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->queue, next);
+        qemu_mutex_unlock(&s->lock);
+
+        if (buf->file >= 0) {
+            char *filename = dump_file_name(s->filename, s->files, buf->file);
+
+            if (s->fd >= 0) {
+                close(s->fd);
+            }
+            s->fd = dump_open(filename, s->pcap_caplen, s->nsec);
+            g_free(filename);
+        }
+        if (s->fd >= 0 &&
+            qemu_write_full(s->fd, buf->data, buf->len) != buf->len) {
+            close(s->fd);
+            s->fd = -1;
+        }
+
+        qemu_mutex_lock(&s->lock);
+        if (s->fd < 0) {
+            s->error = true;
+        }
+        s->queued--;
+        buf->len = 0;
+        buf->file = -1;
+        QSIMPLEQ_INSERT_HEAD(&s->free_bufs, buf, next);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static DumpBuffer *dump_get_buffer(DumpState *s)
+{
+    DumpBuffer *buf;
+
+    qemu_mutex_lock(&s->lock);
+    buf = QSIMPLEQ_FIRST(&s->free_bufs);
+    if (buf) {
+        QSIMPLEQ_REMOVE_HEAD(&s->free_bufs, next);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (!buf) {
+        buf = g_new0(DumpBuffer, 1);
+        buf->data = g_malloc(s->buf_size);
+        buf->file = -1;
+    }
+    return buf;
+}
+
+/*
+ * Hands the current buffer over to the worker thread and starts a new one.
+ * Returns false if too many buffers are already waiting, unless @force.
+ */
+static bool dump_submit(DumpState *s, bool force)
+{
+    bool error;
+
+    if (!s->buf->len && s->buf->file < 0) {
+        return true;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    error = s->error;
+    if (!force && s->queued >= DUMP_MAX_QUEUED) {
+        qemu_mutex_unlock(&s->lock);
+        return false;
+    }
+    QSIMPLEQ_INSERT_TAIL(&s->queue, s->buf, next);
+    s->queued++;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+
+    if (error && !s->failed) {
+        qemu_log("-net dump write error - stop dump\n");
+        s->failed = true;
+    }
+
+    s->buf = dump_get_buffer(s);
+    return true;
+}
+
+static void dump_flush_timer(void *opaque)
+{
+    DumpState *s = opaque;
+
+    dump_submit(s, false);
+}
+
 static ssize_t dump_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
     struct pcap_sf_pkthdr hdr;
     int64_t ts;
     int caplen;
+    size_t reclen;
 
     /* Early return in case of previous error. */
-    if (s->fd < 0) {
+    if (s->failed) {
         return size;
     }
 
-    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000, get_ticks_per_sec());
     caplen = size > s->pcap_caplen ? s->pcap_caplen : size;
+    reclen = sizeof(hdr) + caplen;
+
+    /* Start the next file of the ring if this one would grow too large */
+    if (s->files && s->cur_size + reclen > s->file_size &&
+        s->cur_size > sizeof(struct pcap_file_hdr)) {
+        if (!dump_submit(s, false)) {
+            s->dropped++;
+            return size;
+        }
+        s->cur_file = (s->cur_file + 1) % s->files;
+        s->cur_size = sizeof(struct pcap_file_hdr);
+        s->buf->file = s->cur_file;
+    }
+
+    if (s->buf->len + reclen > s->buf_size && !dump_submit(s, false)) {
+        s->dropped++;
+        return size;
+    }
 
-    hdr.ts.tv_sec = ts / 1000000 + s->start_ts;
-    hdr.ts.tv_usec = ts % 1000000;
+    ts = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), 1000000000,
+                  get_ticks_per_sec());
+
+    hdr.ts.tv_sec = ts / 1000000000 + s->start_ts;
+    hdr.ts.tv_frac = s->nsec ? ts % 1000000000 : ts % 1000000000 / 1000;
     hdr.caplen = caplen;
     hdr.len = size;
-    if (write(s->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
-        write(s->fd, buf, caplen) != caplen) {
-        qemu_log("-net dump write error - stop dump\n");
-        close(s->fd);
-        s->fd = -1;
+
+    if (!s->buf->len) {
+        timer_mod(s->flush_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + DUMP_FLUSH_MS);
     }
+    memcpy(s->buf->data + s->buf->len, &hdr, sizeof(hdr));
+    memcpy(s->buf->data + s->buf->len + sizeof(hdr), buf, caplen);
+    s->buf->len += reclen;
+    s->cur_size += reclen;
 
     return size;
 }
 
+static void dump_free_buffer(DumpBuffer *buf)
+{
+    g_free(buf->data);
+    g_free(buf);
+}
+
 static void dump_cleanup(NetClientState *nc)
 {
     DumpState *s = DO_UPCAST(DumpState, nc, nc);
+    DumpBuffer *buf;
+
+    timer_del(s->flush_timer);
+    timer_free(s->flush_timer);
 
-    close(s->fd);
+    dump_submit(s, true);
+
+    qemu_mutex_lock(&s->lock);
+    s->stop = true;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
+
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    if (s->dropped) {
+        qemu_log("-net dump: %" PRIu64 " packets not dumped\n", s->dropped);
+    }
+
+    dump_free_buffer(s->buf);
+    while ((buf = QSIMPLEQ_FIRST(&s->free_bufs)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->free_bufs, next);
+        dump_free_buffer(buf);
+    }
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->filename);
 }
 
 static NetClientInfo net_dump_info = {
@@ -101,43 +345,53 @@ static NetClientInfo net_dump_info = {
 };
 
 static int net_dump_init(NetClientState *peer, const char *device,
-                         const char *name, const char *filename, int len)
+                         const char *name, const char *filename, int len,
+                         bool nsec, uint64_t file_size, unsigned int files)
 {
-    struct pcap_file_hdr hdr;
     NetClientState *nc;
     DumpState *s;
     struct tm tm;
+    char *first;
     int fd;
 
-    fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0644);
+    first = dump_file_name(filename, files, 0);
+    fd = dump_open(first, len, nsec);
     if (fd < 0) {
-        error_report("-net dump: can't open %s", filename);
-        return -1;
-    }
-
-    hdr.magic = PCAP_MAGIC;
-    hdr.version_major = 2;
-    hdr.version_minor = 4;
-    hdr.thiszone = 0;
-    hdr.sigfigs = 0;
-    hdr.snaplen = len;
-    hdr.linktype = 1;
-
-    if (write(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-        error_report("-net dump write error: %s", strerror(errno));
-        close(fd);
+        error_report("-net dump: can't open %s: %s", first, strerror(errno));
+        g_free(first);
         return -1;
     }
+    g_free(first);
 
     nc = qemu_new_net_client(&net_dump_info, peer, device, name);
+    s = DO_UPCAST(DumpState, nc, nc);
 
-    snprintf(nc->info_str, sizeof(nc->info_str),
-             "dump to %s (len=%d)", filename, len);
+    s->filename = g_strdup(filename);
+    s->pcap_caplen = len;
+    s->nsec = nsec;
+    s->files = files;
+    s->file_size = file_size;
 
-    s = DO_UPCAST(DumpState, nc, nc);
+    if (s->files) {
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "dump to %s.0-%u (len=%d, file-size=%" PRIu64 ")",
+                 filename, s->files - 1, len, file_size);
+    } else {
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "dump to %s (len=%d)", filename, len);
+    }
 
     s->fd = fd;
-    s->pcap_caplen = len;
+    s->cur_size = sizeof(struct pcap_file_hdr);
+    s->buf_size = MAX(DUMP_BUF_SIZE, sizeof(struct pcap_sf_pkthdr) + len);
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    QSIMPLEQ_INIT(&s->queue);
+    QSIMPLEQ_INIT(&s->free_bufs);
+    s->buf = dump_get_buffer(s);
+    s->flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME, dump_flush_timer, s);
+    qemu_thread_create(&s->thread, dump_thread, s, QEMU_THREAD_JOINABLE);
 
     qemu_get_timedate(&tm, 0);
     s->start_ts = mktime(&tm);
@@ -152,6 +406,8 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
     const char *file;
     char def_file[128];
     const NetdevDumpOptions *dump;
+    uint64_t file_size = 0;
+    unsigned int files = 0;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_DUMP);
     dump = opts->dump;
@@ -181,5 +437,19 @@ int net_init_dump(const NetClientOptions *opts, const char *name,
         len = 65536;
     }
 
-    return net_dump_init(peer, "dump", name, file, len);
+    if (dump->has_files && !dump->has_file_size) {
+        error_report("-net dump: files requires file-size");
+        return -1;
+    }
+    if (dump->has_file_size) {
+        file_size = dump->file_size;
+        files = dump->has_files ? dump->files : 2;
+        if (file_size <= sizeof(struct pcap_file_hdr) || !files) {
+            error_report("-net dump: invalid file-size or files");
+            return -1;
+        }
+    }
+
+    return net_dump_init(peer, "dump", name, file, len,
+                         dump->has_nsec && dump->nsec, file_size, files);
 }
@@ -354,7 +354,12 @@ void qemu_del_nic(NICState *nic)
     /* If this is a peer NIC and peer has already been deleted, free it now. */
     if (nic->peer_deleted) {
         for (i = 0; i < queues; i++) {
-            qemu_free_net_client(qemu_get_subqueue(nic, i)->peer);
+            NetClientState *peer = qemu_get_subqueue(nic, i)->peer;
+
+            /* a NIC may have more queues than its peer */
+            if (peer) {
+                qemu_free_net_client(peer);
+            }
         }
     }
 
@@ -426,6 +431,24 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
     return ret;
 }
 
+/* Receiver side of qemu_net_batch_begin(), @opaque is the receiving client */
+void qemu_deliver_batch_begin(void *opaque)
+{
+    NetClientState *nc = opaque;
+
+    nc->receive_batch++;
+}
+
+void qemu_deliver_batch_end(void *opaque)
+{
+    NetClientState *nc = opaque;
+
+    assert(nc->receive_batch > 0);
+    if (--nc->receive_batch == 0 && nc->info->batch_end) {
+        nc->info->batch_end(nc);
+    }
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -452,6 +475,25 @@ void qemu_flush_queued_packets(NetClientState *nc)
     }
 }
 
+/*
+ * Tell the peer of @nc that several packets are going to be sent in a row.
+ * The peer may then defer work that it does after each packet, such as
+ * notifying the guest, until qemu_net_batch_end() is called.
+ */
+void qemu_net_batch_begin(NetClientState *nc)
+{
+    if (nc->peer) {
+        qemu_deliver_batch_begin(nc->peer);
+    }
+}
+
+void qemu_net_batch_end(NetClientState *nc)
+{
+    if (nc->peer) {
+        qemu_deliver_batch_end(nc->peer);
+    }
+}
+
 static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -498,6 +540,10 @@ static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
     uint8_t buffer[NET_BUFSIZE];
     size_t offset;
 
+    if (iovcnt == 1) {
+        return nc->info->receive(nc, iov[0].iov_base, iov[0].iov_len);
+    }
+
     offset = iov_to_buf(iov, iovcnt, 0, buffer, sizeof(buffer));
 
     return nc->info->receive(nc, buffer, offset);
@@ -556,6 +602,28 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Sends the same packet from several clients: if it has to be queued, the
+ * copy is shared through *@shared, which the caller initializes to NULL and
+ * releases with qemu_net_buf_unref() after the last send.
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetBuf **shared)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_shared(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, shared, NULL);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -725,6 +793,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_SOCKET]    = net_init_socket,
 #ifdef CONFIG_VDE
         [NET_CLIENT_OPTIONS_KIND_VDE]       = net_init_vde,
+#endif
+#ifdef CONFIG_AF_PACKET
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
@@ -757,6 +828,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 #ifdef CONFIG_VDE
         case NET_CLIENT_OPTIONS_KIND_VDE:
 #endif
+#ifdef CONFIG_AF_PACKET
+        case NET_CLIENT_OPTIONS_KIND_AF_PACKET:
+#endif
 #ifdef CONFIG_NET_BRIDGE
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
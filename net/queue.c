@@ -23,6 +23,7 @@
 
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -37,14 +38,37 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * Queued packets that fit into NET_QUEUE_SLOT_SIZE are stored in a pool of
+ * slots that is allocated the first time the queue backs up, so that a
+ * receiver that applies backpressure does not cause a malloc/free for every
+ * packet.  Larger (jumbo or GSO) packets and packets that don't find a free
+ * slot are allocated separately.
+ *
+ * A packet that is sent to many receivers (e.g. by a hub) can be queued by
+ * all of them with a single copy: qemu_net_queue_send_shared() copies the
+ * data into a reference-counted NetBuf the first time a receiver has to
+ * queue it, and the other receivers queue a reference to the same NetBuf.
+ * Receivers get the data as const, so it is never modified in place.
  */
 
+#define NET_QUEUE_SLOT_SIZE  2048
+#define NET_QUEUE_POOL_SLOTS 256
+
+struct NetBuf {
+    unsigned int refcnt;
+    size_t size;
+    uint8_t data[0];
+};
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    bool pooled;
+    NetBuf *buf;                /* if set, the data is in buf, not here */
     uint8_t data[0];
 };
 
@@ -55,6 +79,9 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    uint8_t *pool;
+    QTAILQ_HEAD(, NetPacket) free_slots;
+
     unsigned delivering : 1;
 };
 
@@ -69,21 +96,80 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_count = 0;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_slots);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static NetBuf *qemu_net_buf_new(const struct iovec *iov, int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    NetBuf *buf;
+
+    buf = g_malloc(sizeof(NetBuf) + size);
+    buf->refcnt = 1;
+    buf->size = size;
+    iov_to_buf(iov, iovcnt, 0, buf->data, size);
+    return buf;
+}
+
+void qemu_net_buf_unref(NetBuf *buf)
+{
+    if (buf && --buf->refcnt == 0) {
+        g_free(buf);
+    }
+}
+
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int i;
+
+    if (size <= NET_QUEUE_SLOT_SIZE - sizeof(NetPacket)) {
+        if (!queue->pool) {
+            queue->pool = g_malloc(NET_QUEUE_POOL_SLOTS * NET_QUEUE_SLOT_SIZE);
+            for (i = 0; i < NET_QUEUE_POOL_SLOTS; i++) {
+                packet = (NetPacket *)(queue->pool + i * NET_QUEUE_SLOT_SIZE);
+                packet->pooled = true;
+                QTAILQ_INSERT_TAIL(&queue->free_slots, packet, entry);
+            }
+        }
+
+        packet = QTAILQ_FIRST(&queue->free_slots);
+        if (packet) {
+            QTAILQ_REMOVE(&queue->free_slots, packet, entry);
+            return packet;
+        }
+    }
+
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->pooled = false;
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    qemu_net_buf_unref(packet->buf);
+    if (packet->pooled) {
+        /* reuse recently used slots first, they are likely still cached */
+        QTAILQ_INSERT_HEAD(&queue->free_slots, packet, entry);
+    } else {
+        g_free(packet);
+    }
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
 
+    g_free(queue->pool);
     g_free(queue);
 }
 
@@ -99,11 +185,12 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->buf = NULL;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -128,11 +215,12 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->buf = NULL;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -145,6 +233,35 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+static void qemu_net_queue_append_shared(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         NetBuf **shared,
+                                         NetPacketSent *sent_cb)
+{
+    NetPacket *packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        return; /* drop if queue full and no callback */
+    }
+    if (!*shared) {
+        *shared = qemu_net_buf_new(iov, iovcnt);
+    }
+
+    packet = qemu_net_queue_alloc_packet(queue, 0);
+    packet->sender = sender;
+    packet->sent_cb = sent_cb;
+    packet->flags = flags;
+    packet->size = (*shared)->size;
+    packet->buf = *shared;
+    packet->buf->refcnt++;
+
+    queue->nq_count++;
+    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -225,6 +342,39 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Like qemu_net_queue_send_iov(), but if the packet has to be queued, its
+ * data is shared with the other receivers of the same packet through
+ * *@shared (which must be NULL initially, see qemu_net_buf_unref()).
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetBuf **shared,
+                                   NetPacketSent *sent_cb)
+{
+    ssize_t ret;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared, sent_cb);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+    if (ret == 0) {
+        qemu_net_queue_append_shared(queue, sender, flags, iov, iovcnt,
+                                     shared, sent_cb);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -233,13 +383,25 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
             queue->nq_count--;
-            g_free(packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
 
+/*
+ * Delivers the queued packets as one batch, see qemu_net_batch_begin().
+ * Returns false if the receiver could not take all of them.
+ */
 bool qemu_net_queue_flush(NetQueue *queue)
 {
+    bool done = true;
+
+    if (QTAILQ_EMPTY(&queue->packets)) {
+        return true;
+    }
+
+    qemu_deliver_batch_begin(queue->opaque);
+
     while (!QTAILQ_EMPTY(&queue->packets)) {
         NetPacket *packet;
         int ret;
@@ -251,19 +413,23 @@ bool qemu_net_queue_flush(NetQueue *queue)
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
-                                     packet->data,
+                                     packet->buf ? packet->buf->data
+                                                 : packet->data,
                                      packet->size);
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+            done = false;
+            break;
         }
 
         if (packet->sent_cb) {
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
-    return true;
+
+    qemu_deliver_batch_end(queue->opaque);
+    return done;
 }
@@ -33,6 +33,16 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 
+/*
+ * Frames sent while the peer delivers a batch (see qemu_net_batch_begin) are
+ * collected in tx_buf and written with one syscall when the batch ends: one
+ * send() of all length-prefixed frames for streams, one sendmmsg() for
+ * datagrams.  tx_buf also holds what a stream socket could not send yet.
+ * Datagram sockets receive up to NET_SOCKET_BATCH frames per recvmmsg().
+ */
+#define NET_SOCKET_BATCH    32
+#define NET_SOCKET_TX_SIZE  (4 * NET_BUFSIZE)
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
@@ -40,8 +50,16 @@ typedef struct NetSocketState {
     int state; /* 0 = getting length, 1 = getting data */
     unsigned int index;
     unsigned int packet_len;
-    unsigned int send_index;      /* number of bytes sent (only SOCK_STREAM) */
     uint8_t buf[NET_BUFSIZE];
+    uint8_t *tx_buf;              /* frames waiting to be sent */
+    size_t tx_len;                /* bytes used in tx_buf */
+    size_t tx_sent;               /* bytes sent from tx_buf (only SOCK_STREAM) */
+    struct iovec tx_iov[NET_SOCKET_BATCH]; /* frames (only SOCK_DGRAM) */
+    unsigned int tx_count;        /* number of frames in tx_iov */
+    unsigned int tx_done;         /* number of frames sent from tx_iov */
+#ifdef CONFIG_SENDMMSG
+    uint8_t *rx_bufs;             /* NET_SOCKET_BATCH buffers for recvmmsg */
+#endif
     struct sockaddr_in dgram_dst; /* contains inet host and port destination iff connectionless (SOCK_DGRAM) */
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
@@ -50,6 +68,7 @@ typedef struct NetSocketState {
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
+static void net_socket_send_dgram(void *opaque);
 
 /* Only read packets from socket when peer can receive them */
 static int net_socket_can_send(void *opaque)
@@ -80,15 +99,132 @@ static void net_socket_write_poll(NetSocketState *s, bool enable)
     net_socket_update_fd_handler(s);
 }
 
+static void net_socket_tx_reset(NetSocketState *s)
+{
+    s->tx_len = 0;
+    s->tx_sent = 0;
+    s->tx_count = 0;
+    s->tx_done = 0;
+}
+
+/* Appends to tx_buf, which must have room for @size more bytes */
+static void *net_socket_tx_append(NetSocketState *s, const void *data,
+                                  size_t size)
+{
+    void *p;
+
+    if (!s->tx_buf) {
+        s->tx_buf = g_malloc(NET_SOCKET_TX_SIZE);
+    }
+    p = s->tx_buf + s->tx_len;
+    memcpy(p, data, size);
+    s->tx_len += size;
+    return p;
+}
+
+/*
+ * Writes out what is pending in tx_buf.  Returns 0 if everything was sent,
+ * -EAGAIN if the socket is full (the write handler is then enabled), or
+ * another negative errno value, in which case pending frames are dropped.
+ */
+static int net_socket_flush_stream(NetSocketState *s)
+{
+    struct iovec iov;
+    ssize_t ret;
+
+    while (s->tx_sent < s->tx_len) {
+        iov.iov_base = s->tx_buf + s->tx_sent;
+        iov.iov_len = s->tx_len - s->tx_sent;
+        ret = iov_send(s->fd, &iov, 1, 0, iov.iov_len);
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            return -EAGAIN;
+        }
+        if (ret == -1) {
+            net_socket_tx_reset(s);
+            return -errno;
+        }
+        s->tx_sent += ret;
+    }
+    net_socket_tx_reset(s);
+    return 0;
+}
+
+static int net_socket_flush_dgram(NetSocketState *s)
+{
+    ssize_t ret;
+
+    while (s->tx_done < s->tx_count) {
+#ifdef CONFIG_SENDMMSG
+        struct mmsghdr msgs[NET_SOCKET_BATCH];
+        unsigned int i, n = s->tx_count - s->tx_done;
+
+        memset(msgs, 0, sizeof(msgs[0]) * n);
+        for (i = 0; i < n; i++) {
+            msgs[i].msg_hdr.msg_name = &s->dgram_dst;
+            msgs[i].msg_hdr.msg_namelen = sizeof(s->dgram_dst);
+            msgs[i].msg_hdr.msg_iov = &s->tx_iov[s->tx_done + i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        do {
+            ret = sendmmsg(s->fd, msgs, n, 0);
+        } while (ret == -1 && errno == EINTR);
+        if (ret > 0) {
+            s->tx_done += ret;
+            continue;
+        }
+#else
+        do {
+            ret = qemu_sendto(s->fd, s->tx_iov[s->tx_done].iov_base,
+                              s->tx_iov[s->tx_done].iov_len, 0,
+                              (struct sockaddr *)&s->dgram_dst,
+                              sizeof(s->dgram_dst));
+        } while (ret == -1 && errno == EINTR);
+        if (ret >= 0) {
+            s->tx_done++;
+            continue;
+        }
+#endif
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            return -EAGAIN;
+        }
+        /* Like a single sendto() failure, drop the frame that failed */
+        s->tx_done++;
+    }
+    net_socket_tx_reset(s);
+    return 0;
+}
+
+static int net_socket_flush(NetSocketState *s)
+{
+    if (s->send_fn == net_socket_send_dgram) {
+        return net_socket_flush_dgram(s);
+    }
+    return net_socket_flush_stream(s);
+}
+
 static void net_socket_writable(void *opaque)
 {
     NetSocketState *s = opaque;
 
     net_socket_write_poll(s, false);
 
+    if (net_socket_flush(s) == -EAGAIN) {
+        return;
+    }
     qemu_flush_queued_packets(&s->nc);
 }
 
+static void net_socket_batch_end(NetClientState *nc)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    if (!s->write_poll) {
+        net_socket_flush(s);
+    }
+}
+
 static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -102,25 +238,47 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
             .iov_len  = size,
         },
     };
-    size_t remaining;
+    size_t total = iov_size(iov, 2);
     ssize_t ret;
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    ret = iov_send(s->fd, iov, 2, s->send_index, remaining);
-
-    if (ret == -1 && errno == EAGAIN) {
-        ret = 0; /* handled further down */
+    if (s->tx_len + total > NET_SOCKET_TX_SIZE) {
+        /* Make room, or have the net layer queue the frame meanwhile */
+        ret = net_socket_flush_stream(s);
+        if (ret == -EAGAIN) {
+            return 0;
+        }
     }
-    if (ret == -1) {
-        s->send_index = 0;
-        return -errno;
+
+    if (!s->tx_len && !nc->receive_batch) {
+        /* Nothing pending and no batch: send right away, without a copy */
+        ret = iov_send(s->fd, iov, 2, 0, total);
+        if (ret == -1 && errno == EAGAIN) {
+            ret = 0; /* handled further down */
+        }
+        if (ret == -1) {
+            return -errno;
+        }
+        if ((size_t)ret < total) {
+            /* Keep the rest, it must be sent before any other frame */
+            size_t done = ret;
+
+            if (done < sizeof(len)) {
+                net_socket_tx_append(s, (uint8_t *)&len + done,
+                                     sizeof(len) - done);
+                done = sizeof(len);
+            }
+            net_socket_tx_append(s, buf + done - sizeof(len),
+                                 total - done);
+            net_socket_write_poll(s, true);
+        }
+        return size;
     }
-    if (ret < (ssize_t)remaining) {
-        s->send_index += ret;
-        net_socket_write_poll(s, true);
-        return 0;
+
+    net_socket_tx_append(s, &len, sizeof(len));
+    net_socket_tx_append(s, buf, size);
+    if (!nc->receive_batch && !s->write_poll) {
+        net_socket_flush_stream(s);
     }
-    s->send_index = 0;
     return size;
 }
 
@@ -129,6 +287,25 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
     ssize_t ret;
 
+    if (s->tx_count == NET_SOCKET_BATCH ||
+        s->tx_len + size > NET_SOCKET_TX_SIZE) {
+        if (net_socket_flush_dgram(s) == -EAGAIN) {
+            return 0;
+        }
+    }
+
+    if (nc->receive_batch) {
+        s->tx_iov[s->tx_count].iov_base = net_socket_tx_append(s, buf, size);
+        s->tx_iov[s->tx_count].iov_len = size;
+        s->tx_count++;
+        return size;
+    }
+
+    if (s->tx_count) {
+        /* Earlier frames are waiting for the socket */
+        return 0;
+    }
+
     do {
         ret = qemu_sendto(s->fd, buf, size, 0,
                           (struct sockaddr *)&s->dgram_dst,
@@ -170,12 +347,16 @@ static void net_socket_send(void *opaque)
         s->index = 0;
         s->packet_len = 0;
         s->nc.link_down = true;
+        net_socket_tx_reset(s);
         memset(s->buf, 0, sizeof(s->buf));
         memset(s->nc.info_str, 0, sizeof(s->nc.info_str));
 
         return;
     }
     buf = buf1;
+
+    /* All frames of one read are delivered to the peer as a batch */
+    qemu_net_batch_begin(&s->nc);
     while (size > 0) {
         /* reassemble a packet from the network */
         switch(s->state) {
@@ -204,6 +385,7 @@ static void net_socket_send(void *opaque)
                 fprintf(stderr, "serious error: oversized packet received,"
                     "connection terminated.\n");
                 s->state = 0;
+                qemu_net_batch_end(&s->nc);
                 goto eoc;
             }
 
@@ -218,8 +400,45 @@ static void net_socket_send(void *opaque)
             break;
         }
     }
+    qemu_net_batch_end(&s->nc);
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[NET_SOCKET_BATCH];
+    struct iovec iov[NET_SOCKET_BATCH];
+    int i, n;
+
+    if (!s->rx_bufs) {
+        s->rx_bufs = g_malloc(NET_SOCKET_BATCH * NET_BUFSIZE);
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NET_SOCKET_BATCH; i++) {
+        iov[i].iov_base = s->rx_bufs + i * NET_BUFSIZE;
+        iov[i].iov_len = NET_BUFSIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(s->fd, msgs, NET_SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return;
+    }
+
+    qemu_net_batch_begin(&s->nc);
+    for (i = 0; i < n; i++) {
+        if (msgs[i].msg_len) {
+            qemu_send_packet(&s->nc, iov[i].iov_base, msgs[i].msg_len);
+        }
+    }
+    qemu_net_batch_end(&s->nc);
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -236,6 +455,7 @@ static void net_socket_send_dgram(void *opaque)
     }
     qemu_send_packet(&s->nc, s->buf, size);
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -336,12 +556,17 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+    g_free(s->tx_buf);
+#ifdef CONFIG_SENDMMSG
+    g_free(s->rx_bufs);
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+    .batch_end = net_socket_batch_end,
     .cleanup = net_socket_cleanup,
 };
 
@@ -424,6 +649,7 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .batch_end = net_socket_batch_end,
     .cleanup = net_socket_cleanup,
 };
 
@@ -44,6 +44,9 @@
 
 #include "net/vhost_net.h"
 
+/* Maximum number of frames read from the tap device per wakeup */
+#define TAP_RX_BATCH 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
@@ -185,10 +188,18 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/*
+ * Reads up to TAP_RX_BATCH frames per wakeup and delivers them to the peer
+ * as one batch, so that e.g. virtio-net notifies the guest only once.
+ * The budget keeps a busy tap device from starving the main loop.
+ */
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
+    int packets = 0;
+
+    qemu_net_batch_begin(&s->nc);
 
     do {
         uint8_t *buf = s->buf;
@@ -207,7 +218,10 @@ static void tap_send(void *opaque)
         if (size == 0) {
             tap_read_poll(s, false);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && ++packets < TAP_RX_BATCH &&
+             qemu_can_send_packet(&s->nc));
+
+    qemu_net_batch_end(&s->nc);
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -25,6 +25,7 @@
 #include "util.h"
 #include <errno.h>
 #include <stdlib.h>
+#include "net/eth.h"
 
 int net_parse_macaddr(uint8_t *macaddr, const char *p)
 {
@@ -58,3 +59,20 @@ int net_parse_macaddr(uint8_t *macaddr, const char *p)
 
     return 0;
 }
+
+/*
+ * Returns the size of the largest frame in @iov that a host interface with
+ * the given MTU can send.  Like Linux, allow for an 802.1Q tag on top of the
+ * MTU if the frame carries one.
+ */
+size_t net_max_frame_len(const struct iovec *iov, int iovcnt, int mtu)
+{
+    struct eth_header ehdr;
+    size_t len = sizeof(struct eth_header) + mtu;
+
+    if (iov_to_buf(iov, iovcnt, 0, &ehdr, sizeof(ehdr)) == sizeof(ehdr) &&
+        be16_to_cpu(ehdr.h_proto) == ETH_P_VLAN) {
+        len += sizeof(struct vlan_header);
+    }
+    return len;
+}
@@ -25,8 +25,9 @@
 #ifndef QEMU_NET_UTIL_H
 #define QEMU_NET_UTIL_H
 
-#include <stdint.h>
+#include "qemu-common.h"
 
 int net_parse_macaddr(uint8_t *macaddr, const char *p);
+size_t net_max_frame_len(const struct iovec *iov, int iovcnt, int mtu);
 
 #endif /* QEMU_NET_UTIL_H */
@@ -106,6 +106,11 @@ static void help(void)
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -880,6 +885,107 @@ static int check_empty_sectors(BlockDriverState *bs, int64_t sect_num,
     return 0;
 }
 
+/*
+ * Returns the status of @sector_num as seen through the whole backing chain
+ * of @bs: BDRV_BLOCK_ZERO if the sectors are known to read as zeroes,
+ * BDRV_BLOCK_DATA if they have to be read to know their contents, or a
+ * negative errno value.
+ *
+ * @pnum is set to the number of sectors (at most @nb_sectors) that share
+ * this status.
+ */
+static int64_t get_chain_block_status(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
+{
+    int64_t ret;
+
+    *pnum = nb_sectors;
+    for (; bs; bs = bs->backing_hd) {
+        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, pnum);
+        if (ret < 0) {
+            return ret;
+        }
+        if (*pnum == 0) {
+            /* Beyond the end of a shorter backing file */
+            *pnum = nb_sectors;
+            return BDRV_BLOCK_ZERO;
+        }
+        if (ret & BDRV_BLOCK_ZERO) {
+            return BDRV_BLOCK_ZERO;
+        }
+        if (ret & BDRV_BLOCK_DATA) {
+            return BDRV_BLOCK_DATA;
+        }
+        /* Unallocated in this layer, look at the next one */
+        nb_sectors = *pnum;
+    }
+
+    /* Not allocated anywhere in the chain */
+    return BDRV_BLOCK_ZERO;
+}
+
+typedef struct CompareReadData {
+    int ret;
+    bool done;
+} CompareReadData;
+
+static void compare_read_cb(void *opaque, int ret)
+{
+    CompareReadData *data = opaque;
+
+    data->ret = ret;
+    data->done = true;
+}
+
+static void compare_submit_read(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors, uint8_t *buf,
+                                QEMUIOVector *qiov, struct iovec *iov,
+                                CompareReadData *data)
+{
+    iov->iov_base = buf;
+    iov->iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(qiov, iov, 1);
+
+    data->done = false;
+    if (!bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                        compare_read_cb, data)) {
+        data->ret = -EIO;
+        data->done = true;
+    }
+}
+
+/*
+ * Reads the same range from both images with both requests in flight at the
+ * same time.  Returns 0 on success; on failure, returns a negative errno
+ * value and sets @failed to the index (1 or 2) of the image that failed.
+ */
+static int compare_read_both(BlockDriverState *bs1, BlockDriverState *bs2,
+                             int64_t sector_num, int nb_sectors,
+                             uint8_t *buf1, uint8_t *buf2, int *failed)
+{
+    QEMUIOVector qiov1, qiov2;
+    struct iovec iov1, iov2;
+    CompareReadData data1, data2;
+
+    compare_submit_read(bs1, sector_num, nb_sectors, buf1, &qiov1, &iov1,
+                        &data1);
+    compare_submit_read(bs2, sector_num, nb_sectors, buf2, &qiov2, &iov2,
+                        &data2);
+    while (!data1.done || !data2.done) {
+        qemu_aio_wait();
+    }
+
+    if (data1.ret < 0) {
+        *failed = 1;
+        return data1.ret;
+    }
+    if (data2.ret < 0) {
+        *failed = 2;
+        return data2.ret;
+    }
+    return 0;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -979,78 +1085,93 @@ static int img_compare(int argc, char **argv)
     }
 
     for (;;) {
+        int64_t status1, status2;
+
         nb_sectors = sectors_to_process(total_sectors, sector_num);
         if (nb_sectors <= 0) {
             break;
         }
-        allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num, nb_sectors,
-                                             &pnum1);
-        if (allocated1 < 0) {
+        status1 = get_chain_block_status(bs1, sector_num, nb_sectors, &pnum1);
+        if (status1 < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename1);
             goto out;
         }
 
-        allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num, nb_sectors,
-                                             &pnum2);
-        if (allocated2 < 0) {
+        status2 = get_chain_block_status(bs2, sector_num, nb_sectors, &pnum2);
+        if (status2 < 0) {
             ret = 3;
             error_report("Sector allocation test failed for %s", filename2);
             goto out;
         }
         nb_sectors = MIN(pnum1, pnum2);
 
-        if (allocated1 == allocated2) {
-            if (allocated1) {
-                ret = bdrv_read(bs1, sector_num, buf1, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64 " of %s:"
-                                 " %s", sectors_to_bytes(sector_num), filename1,
-                                 strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = bdrv_read(bs2, sector_num, buf2, nb_sectors);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s", sectors_to_bytes(sector_num),
-                                 filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
-                if (ret || pnum != nb_sectors) {
-                    ret = 1;
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            sectors_to_bytes(
-                                ret ? sector_num : sector_num + pnum));
-                    goto out;
-                }
+        if (strict) {
+            allocated1 = bdrv_is_allocated_above(bs1, NULL, sector_num,
+                                                 nb_sectors, &pnum1);
+            if (allocated1 < 0) {
+                ret = 3;
+                error_report("Sector allocation test failed for %s",
+                             filename1);
+                goto out;
             }
-        } else {
-            if (strict) {
+
+            allocated2 = bdrv_is_allocated_above(bs2, NULL, sector_num,
+                                                 nb_sectors, &pnum2);
+            if (allocated2 < 0) {
+                ret = 3;
+                error_report("Sector allocation test failed for %s",
+                             filename2);
+                goto out;
+            }
+
+            if (allocated1 != allocated2) {
                 ret = 1;
                 qprintf(quiet, "Strict mode: Offset %" PRId64
                         " allocation mismatch!\n",
                         sectors_to_bytes(sector_num));
                 goto out;
             }
+            nb_sectors = MIN(pnum1, pnum2);
+        }
 
-            if (allocated1) {
-                ret = check_empty_sectors(bs1, sector_num, nb_sectors,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(bs2, sector_num, nb_sectors,
-                                          filename2, buf1, quiet);
+        if (status1 == BDRV_BLOCK_DATA && status2 == BDRV_BLOCK_DATA) {
+            int failed;
+
+            ret = compare_read_both(bs1, bs2, sector_num, nb_sectors,
+                                    buf1, buf2, &failed);
+            if (ret < 0) {
+                error_report("Error while reading offset %" PRId64 " of %s:"
+                             " %s", sectors_to_bytes(sector_num),
+                             failed == 1 ? filename1 : filename2,
+                             strerror(-ret));
+                ret = 4;
+                goto out;
             }
-            if (ret) {
-                if (ret < 0) {
-                    ret = 4;
-                    error_report("Error while reading offset %" PRId64 ": %s",
-                                 sectors_to_bytes(sector_num), strerror(-ret));
-                }
+            ret = compare_sectors(buf1, buf2, nb_sectors, &pnum);
+            if (ret || pnum != nb_sectors) {
+                ret = 1;
+                qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                        sectors_to_bytes(
+                            ret ? sector_num : sector_num + pnum));
                 goto out;
             }
+        } else if (status1 == BDRV_BLOCK_DATA) {
+            ret = check_empty_sectors(bs1, sector_num, nb_sectors,
+                                      filename1, buf1, quiet);
+        } else if (status2 == BDRV_BLOCK_DATA) {
+            ret = check_empty_sectors(bs2, sector_num, nb_sectors,
+                                      filename2, buf1, quiet);
+        }
+        /* Ranges reading as zeroes on both sides are equal */
+
+        if (ret) {
+            if (ret < 0) {
+                ret = 4;
+                error_report("Error while reading offset %" PRId64 ": %s",
+                             sectors_to_bytes(sector_num), strerror(-ret));
+            }
+            goto out;
         }
         sector_num += nb_sectors;
         qemu_progress_print(((float) nb_sectors / progress_base)*100, 100);
@@ -1058,7 +1179,7 @@ static int img_compare(int argc, char **argv)
 
     if (total_sectors1 != total_sectors2) {
         BlockDriverState *bs_over;
-        int64_t total_sectors_over;
+        int64_t total_sectors_over, status;
         const char *filename_over;
 
         qprintf(quiet, "Warning: Image size mismatch!\n");
@@ -1077,9 +1198,9 @@ static int img_compare(int argc, char **argv)
             if (nb_sectors <= 0) {
                 break;
             }
-            ret = bdrv_is_allocated_above(bs_over, NULL, sector_num,
-                                          nb_sectors, &pnum);
-            if (ret < 0) {
+            status = get_chain_block_status(bs_over, sector_num,
+                                            nb_sectors, &pnum);
+            if (status < 0) {
                 ret = 3;
                 error_report("Sector allocation test failed for %s",
                              filename_over);
@@ -1087,7 +1208,7 @@ static int img_compare(int argc, char **argv)
 
             }
             nb_sectors = pnum;
-            if (ret) {
+            if (status == BDRV_BLOCK_DATA) {
                 ret = check_empty_sectors(bs_over, sector_num, nb_sectors,
                                           filename_over, buf1, quiet);
                 if (ret) {
@@ -1119,27 +1240,442 @@ out3:
     return ret;
 }
 
+/*
+ * State shared by the coroutines of a parallel conversion.  Each coroutine
+ * picks the next chunk of the virtual disk under @lock, reads it into its own
+ * buffer and writes it out, so up to @num_coroutines requests are in flight
+ * on both the source and the target.
+ */
+
+#define MAX_COROUTINES 16
+
+typedef enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+} ImgConvertBlockStatus;
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
+    ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int cluster_sectors;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Find out how many sectors starting at @sector_num share the same status,
+ * updating s->status accordingly.  Returns the number of sectors or a
+ * negative errno value.
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t ret, src_cur_offset;
+    int n, src_cur;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+
+    assert(s->total_sectors > sector_num);
+    n = MIN(s->total_sectors - sector_num, INT_MAX >> BDRV_SECTOR_BITS);
+
+    if (s->sector_next_status <= sector_num) {
+        ret = bdrv_get_block_status(s->src[src_cur],
+                                    sector_num - src_cur_offset, n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (ret & BDRV_BLOCK_ZERO) {
+            s->status = BLK_ZERO;
+        } else if (ret & BDRV_BLOCK_DATA) {
+            s->status = BLK_DATA;
+        } else if (!s->target_has_backing) {
+            /* Without a target backing file we must copy over the contents
+             * of the backing file as well. */
+            s->status = BLK_DATA;
+        } else {
+            s->status = BLK_BACKING_FILE;
+        }
+
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /* Compressed images are written cluster by cluster, so an unallocated
+     * area shorter than a cluster has to be treated as allocated. */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    int n, ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        BlockDriverState *bs;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+
+        /* In the case of compression with multiple source files, we can get a
+         * nb_sectors that spreads into the next part. So we must be able to
+         * read across multiple BDSes for one convert_co_read() call. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        bs = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(bs, sector_num - src_cur_offset, n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         ImgConvertBlockStatus status)
+{
+    int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* If we have a backing file, leave clusters unallocated that are
+             * unallocated in the source image, so that the backing file is
+             * visible at the respective offset. */
+            assert(s->target_has_backing);
+            break;
+
+        case BLK_DATA:
+            /* We must always write compressed clusters as a whole, so don't
+             * try to find zeroed parts in the buffer.  The write can only be
+             * skipped if the whole buffer is zero. */
+            if (s->compressed) {
+                if (s->has_zero_init &&
+                    buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
+                    break;
+                }
+
+                ret = bdrv_write_compressed(s->target, sector_num, buf, n);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+            }
+
+            /* If there is real non-zero data or the target does not read
+             * back as zero, we must write it.  Otherwise we can treat it as
+             * zero sectors. */
+            if (!s->has_zero_init ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+            }
+            /* fall-through */
+
+        case BLK_ZERO:
+            if (s->has_zero_init) {
+                break;
+            }
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void convert_wake_waiters(ImgConvertState *s, int64_t sector_num)
+{
+    int i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] != -1 &&
+            (sector_num < 0 || s->wait_sector_num[i] == sector_num)) {
+            /*
+             * A -> B -> A cannot occur because A has
+             * s->wait_sector_num[i] == -1 during A -> B.  Therefore
+             * B will never enter A during this time window.
+             */
+            qemu_coroutine_enter(s->co[i], NULL);
+            if (sector_num >= 0) {
+                break;
+            }
+        }
+    }
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            sector_num = s->sector_num;
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading metadata for sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        /* Save the current position and status, then advance the global
+         * position so that other coroutines can already read ahead */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            goto out;
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited
+             * for this write to complete */
+            s->wr_offs = sector_num + n;
+            convert_wake_waiters(s, s->wr_offs);
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->wait_sector_num[index] = -1;
+    s->running_coroutines--;
+    if (s->ret != -EINPROGRESS && s->wr_in_order) {
+        /* Let coroutines stuck waiting for their turn see the error */
+        convert_wake_waiters(s, -1);
+    }
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int ret, i, n;
+    int64_t sector_num = 0;
+
+    /* Check whether we have zero initialisation or can get it efficiently */
+    s->has_zero_init = !s->target_has_backing &&
+                       bdrv_has_zero_init(s->target);
+
+    /* Allocate buffer for copied data. For compressed images, only one
+     * cluster can be copied at a time. */
+    if (s->compressed) {
+        BlockDriverInfo bdi;
+
+        ret = bdrv_get_info(s->target, &bdi);
+        if (ret < 0) {
+            error_report("could not get block driver info");
+            return ret;
+        }
+        if (bdi.cluster_size <= 0 || bdi.cluster_size > IO_BUF_SIZE) {
+            error_report("invalid cluster size");
+            return -EINVAL;
+        }
+        s->cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+        s->buf_sectors = s->cluster_sectors;
+    }
+
+    /* Calculate allocated sectors for progress */
+    s->allocated_sectors = 0;
+    while (sector_num < s->total_sectors) {
+        n = convert_iteration_sectors(s, sector_num);
+        if (n < 0) {
+            error_report("error while reading metadata for sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            return n;
+        }
+        if (s->status == BLK_DATA) {
+            s->allocated_sectors += n;
+        }
+        sector_num += n;
+    }
+
+    /* Do the copy */
+    s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->allocated_done = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
+
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->wait_sector_num[i] = -1;
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->compressed && !s->ret) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size,
-        cluster_sectors, skip_create;
+    int c, ret = 0, bs_n, bs_i, compress, skip_create;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
-    BlockDriverInfo bdi;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t bs_len;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
     bool quiet = false;
     Error *local_err = NULL;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1148,7 +1684,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qn");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qnm:W");
         if (c == -1) {
             break;
         }
@@ -1208,6 +1744,22 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1240,6 +1792,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -1250,8 +1803,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &bs_len);
+        bs_sectors[bs_i] = bs_len;
+        total_sectors += bs_len;
     }
 
     if (snapshot_name != NULL) {
@@ -1364,11 +1918,6 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
-
     if (skip_create) {
         int64_t output_length = bdrv_getlength(out_bs);
         if (output_length < 0) {
@@ -1383,178 +1932,25 @@ static int img_convert(int argc, char **argv)
         }
     }
 
-    if (compress) {
-        ret = bdrv_get_info(out_bs, &bdi);
-        if (ret < 0) {
-            error_report("could not get block driver info");
-            goto out;
-        }
-        cluster_size = bdi.cluster_size;
-        if (cluster_size <= 0 || cluster_size > IO_BUF_SIZE) {
-            error_report("invalid cluster size");
-            ret = -1;
-            goto out;
-        }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
-        }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            /* If the output image is being created as a copy on write image,
-               assume that sectors which are unallocated in the input image
-               are present in both the output's and input's base images (no
-               need to copy them). */
-            if (out_baseimg) {
-                ret = bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                        n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading metadata for sector "
-                                 "%" PRId64 ": %s",
-                                 sector_num - bs_offset, strerror(-ret));
-                    goto out;
-                }
-                if (!ret) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* The next 'n1' sectors are allocated in the input image. Copy
-                   only those as they may be followed by unallocated sectors. */
-                n = n1;
-            } else {
-                n1 = n;
-            }
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = (bool) out_baseimg,
+        .min_sparse         = min_sparse,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
+    };
+    ret = convert_do_copy(&state);
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
     if (out_bs) {
         bdrv_unref(out_bs);
     }
@@ -1566,6 +1962,7 @@ out:
         }
         g_free(bs);
     }
+    g_free(bs_sectors);
     if (ret) {
         return 1;
     }
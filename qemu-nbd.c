@@ -38,6 +38,8 @@
 #define QEMU_NBD_OPT_CACHE   1
 #define QEMU_NBD_OPT_AIO     2
 #define QEMU_NBD_OPT_DISCARD 3
+#define QEMU_NBD_OPT_MAX_REQUESTS 4
+#define QEMU_NBD_OPT_SPARSE_READS 5
 
 static NBDExport *exp;
 static int verbose;
@@ -63,6 +65,8 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"      --max-requests=NUM  allow NUM requests in flight per client\n"
+"                       (default '%d')\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
@@ -85,9 +89,10 @@ static void usage(const char *name)
 #ifdef CONFIG_LINUX_AIO
 "      --aio=MODE       set AIO mode (native or threads)\n"
 #endif
+"      --sparse-reads   don't read ranges that the image reports as zero\n"
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", NBD_DEFAULT_MAX_REQUESTS);
 }
 
 static void version(const char *name)
@@ -335,6 +340,8 @@ int main(int argc, char **argv)
 #endif
         { "discard", 1, NULL, QEMU_NBD_OPT_DISCARD },
         { "shared", 1, NULL, 'e' },
+        { "max-requests", 1, NULL, QEMU_NBD_OPT_MAX_REQUESTS },
+        { "sparse-reads", 0, NULL, QEMU_NBD_OPT_SPARSE_READS },
         { "format", 1, NULL, 'f' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
@@ -346,6 +353,8 @@ int main(int argc, char **argv)
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
+    int max_requests = NBD_DEFAULT_MAX_REQUESTS;
+    bool sparse_reads = false;
     int ret;
     int fd;
     bool seen_cache = false;
@@ -459,6 +468,19 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            max_requests = strtol(optarg, &end, 0);
+            if (*end) {
+                errx(EXIT_FAILURE, "Invalid request limit '%s'", optarg);
+            }
+            if (max_requests < 1 || max_requests > NBD_MAX_REQUESTS_LIMIT) {
+                errx(EXIT_FAILURE, "Request limit must be between 1 and %d",
+                     NBD_MAX_REQUESTS_LIMIT);
+            }
+            break;
+        case QEMU_NBD_OPT_SPARSE_READS:
+            sparse_reads = true;
+            break;
         case 'f':
             fmt = optarg;
             break;
@@ -592,6 +614,8 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    nbd_export_set_max_requests(exp, max_requests);
+    nbd_export_set_sparse_reads(exp, sparse_reads);
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
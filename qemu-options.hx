@@ -409,11 +409,13 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,copy-on-read-readahead=s]\n"
+    "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
     "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
     "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
-    "       [[,iops_size=is]]\n"
+    "       [[,iops_size=is]][,group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -450,6 +452,14 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
+@item detect-zeroes=@var{detect-zeroes}
+@var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
+conversion of plain zero writes by the OS to driver specific optimized
+zero write commands.  The data of every write request is scanned, so this
+costs some CPU time.  With "unmap", zero writes that cover whole clusters
+are additionally turned into discards if the image format guarantees that
+discarded clusters read back as zeroes (qcow2 images without a backing
+file); this requires discard=unmap.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -469,6 +479,19 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item copy-on-read-readahead=@var{size}
+When copy-on-read is active and the guest reads sequentially, copy up to
+@var{size} bytes after the current position into the image file in the
+background, so that the following reads don't have to wait for the backing
+file.  This also applies to the reads of the guest while a @code{block-stream}
+job runs.  Stopping the VM or any other operation that waits for pending
+I/O ends the readahead after its current request.  The default is 0, which
+disables readahead.
+@item group=@var{g}
+Put the drive in the I/O throttling group @var{g}. The bps and iops limits
+of a group are shared by all of its drives, and requests of the drives are
+served in turn when the group is throttled. Drives with I/O limits but without
+a group are throttled on their own.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -1409,8 +1432,16 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
 #endif
-    "-net dump[,vlan=n][,file=f][,len=n]\n"
+#ifdef CONFIG_AF_PACKET
+    "-net af-packet[,vlan=n][,name=str],ifname=name[,block-size=n][,blocks=n]\n"
+    "         [,timeout=ms][,frames=n]\n"
+    "                connect the vlan 'n' to the host network interface 'name'\n"
+    "                through a packet socket with memory-mapped rings\n"
+#endif
+    "-net dump[,vlan=n][,file=f][,len=n][,nsec=on|off][,file-size=n[,files=n]]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
+    "                use 'nsec=on' to record nanosecond timestamps\n"
+    "                use 'file-size=n' to rotate over 'files' files of n bytes\n"
     "-net none       use it alone to have zero network devices. If no -net option\n"
     "                is provided, the default is '-net nic -net user'\n", QEMU_ARCH_ALL)
 DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
@@ -1422,6 +1453,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "bridge|"
 #ifdef CONFIG_VDE
     "vde|"
+#endif
+#ifdef CONFIG_AF_PACKET
+    "af-packet|"
 #endif
     "socket|"
     "hubport],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
@@ -1746,6 +1780,31 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,block-size=@var{size}][,blocks=@var{n}][,timeout=@var{ms}][,frames=@var{n}]
+@item -net af-packet[,vlan=@var{n}][,name=@var{name}],ifname=@var{name}[,block-size=@var{size}][,blocks=@var{n}][,timeout=@var{ms}][,frames=@var{n}]
+Connect VLAN @var{n} to the host network interface @var{ifname} through a
+Linux packet socket.  Frames are exchanged through receive and transmit rings
+shared with the kernel (TPACKET_V3), so that no system call is needed per
+frame.  The interface is put in promiscuous mode.  This option is only
+available on Linux hosts and usually requires the CAP_NET_RAW capability.
+
+The receive ring has @var{blocks} blocks (8 by default) of @var{size} bytes
+(1M by default, a multiple of the host page size).  The kernel hands a block
+over to QEMU when it is full, or @var{ms} milliseconds (1 by default) after
+its first frame was received.  The transmit ring has @var{frames} frames (256
+by default); if the host kernel does not support TPACKET_V3 transmit rings,
+frames are sent with one system call each.
+
+Example:
+@example
+# create a veth pair for local testing
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+qemu-system-i386 linux.img -netdev af-packet,id=n1,ifname=veth0 \
+                 -device virtio-net-pci,netdev=n1
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -1754,10 +1813,18 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
+@item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}][,nsec=on|off][,file-size=@var{size}[,files=@var{n}]]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
 libpcap, so it can be analyzed with tools such as tcpdump or Wireshark.
+With @option{nsec=on}, timestamps have nanosecond resolution.
+
+Packets are buffered and written by a separate thread.  If the disk cannot keep
+up, packets are left out of the dump rather than slowing down the network.
+
+With @option{file-size}, the dump rotates over @var{n} files (2 by default)
+named @file{@var{file}.0}, @file{@var{file}.1}, ..., each at most @var{size}
+bytes long.  When the last file is full, the first one is overwritten.
 
 @item -net none
 Indicate that no network devices should be configured. It is used to
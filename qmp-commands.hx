@@ -917,7 +917,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,workers:i?,"
+                      "bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
 
@@ -944,8 +945,8 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
-  (MirrorSyncMode).
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for the sectors marked in "bitmap" (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
@@ -957,12 +958,77 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "workers": how many clusters the background copy keeps in flight at the
+             same time (json-int, optional, default 1)
+- "bitmap": the name of a dirty bitmap of the device, required for sync mode
+            "incremental".  With "full" and "incremental", the bitmap is
+            cleared when the job starts; the sectors are marked dirty again
+            if the job fails or is cancelled (json-string, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
                                                "sync": "full",
                                                "target": "backup.img" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,file:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that records the sectors written to a device,
+for use with drive-backup.  See docs/bitmaps.txt.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the bitmap, unique per device (json-string)
+- "granularity": granularity of the bitmap in bytes, a power of 2 of at least
+                 512 (json-int, optional, default 64K or the granularity of
+                 "file")
+- "file": a file to keep the bitmap in across restarts; it is loaded if it
+          exists and stored when the bitmap is removed or the device is
+          closed (json-string, optional)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add",
+     "arguments": { "device": "drive0", "name": "backup0",
+                    "file": "/var/lib/vm/drive0.bitmap" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Delete a named dirty bitmap.  A persistent bitmap is stored to its file
+first.  Bitmaps in use by a backup job can't be removed.
+
+Arguments:
+
+- "device": the name of the block device (json-string)
+- "name": the name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove",
+     "arguments": { "device": "drive0", "name": "backup0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1171,7 +1237,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,max-in-flight:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1198,6 +1264,8 @@ Arguments:
 - "granularity": granularity of the dirty bitmap, in bytes (json-int, optional)
 - "buf_size": maximum amount of data in flight from source to target, in bytes
   (json-int, default 10M)
+- "max-in-flight": maximum number of concurrent requests; the number actually
+  in flight is adapted to the observed latency (json-int, default 16)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
   allocated in the topmost image, or "none" to only replicate new I/O
@@ -1477,7 +1545,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1503,6 +1571,8 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group name; the limits are shared by all devices in
+           the group (json-string, optional)
 
 Example:
 
@@ -1867,6 +1937,10 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group the limits belong to (json-string,
+                    optional)
+         - "detect_zeroes": detect and optimize zero writes (json-string)
+             - Possible values: "off", "on", "unmap"
          - "image": the detail of the image, it is a json-object containing
             the following:
              - "filename": image file name (json-string)
@@ -1930,6 +2004,7 @@ Example:
                "encrypted":false,
                "file":"disks/test.qcow2",
                "backing_file_depth":1,
+               "detect_zeroes":"off",
                "bps":1000000,
                "bps_rd":0,
                "bps_wr":0,
@@ -1943,6 +2018,7 @@ Example:
                "iops_rd_max": 0,
                "iops_wr_max": 0,
                "iops_size": 0,
+               "group": "ide0-hd0",
                "image":{
                   "filename":"disks/test.qcow2",
                   "format":"qcow2",
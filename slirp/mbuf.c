@@ -13,18 +13,30 @@
  * could hold, an external malloced buffer is pointed to
  * by m_ext (and the data pointers) and M_EXT is set in
  * the flags
+ *
+ * mbufs are allocated MBUF_SLAB_COUNT at a time and are never
+ * returned to malloc, only to the free list of their Slirp
+ * instance.  A few external buffers are kept around as well,
+ * so that large packets don't cause a malloc/free each.
  */
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  * XXX if_maxlinkhdr already in mtu
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
 
+#define MBUF_SLAB_COUNT 32
+#define MBUF_STRIDE     ((SLIRP_MSIZE + 15) & ~15)
+
+struct mbuf_slab {
+    struct mbuf_slab *next;
+    char pad[16 - sizeof(struct mbuf_slab *)];
+    char mbufs[0];
+};
+
 void
 m_init(Slirp *slirp)
 {
@@ -34,56 +46,104 @@ m_init(Slirp *slirp)
 
 void m_cleanup(Slirp *slirp)
 {
-    struct mbuf *m, *next;
+    struct mbuf *m;
+    struct mbuf_slab *slab, *next;
+    int i;
 
-    m = slirp->m_usedlist.m_next;
-    while (m != &slirp->m_usedlist) {
-        next = m->m_next;
+    for (m = slirp->m_usedlist.m_next; m != &slirp->m_usedlist;
+         m = m->m_next) {
         if (m->m_flags & M_EXT) {
             free(m->m_ext);
         }
-        free(m);
-        m = next;
     }
-    m = slirp->m_freelist.m_next;
-    while (m != &slirp->m_freelist) {
-        next = m->m_next;
-        free(m);
-        m = next;
+    for (i = 0; i < slirp->m_ext_cached; i++) {
+        free(slirp->m_ext_cache[i].buf);
+    }
+    slirp->m_ext_cached = 0;
+
+    for (slab = slirp->m_slabs; slab; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    slirp->m_slabs = NULL;
+}
+
+/* Refills the free list with a new slab of mbufs */
+static int m_alloc_slab(Slirp *slirp)
+{
+    struct mbuf_slab *slab;
+    struct mbuf *m;
+    int i;
+
+    slab = malloc(sizeof(*slab) + MBUF_SLAB_COUNT * MBUF_STRIDE);
+    if (slab == NULL) {
+        return -1;
+    }
+    slab->next = slirp->m_slabs;
+    slirp->m_slabs = slab;
+
+    for (i = 0; i < MBUF_SLAB_COUNT; i++) {
+        m = (struct mbuf *)(slab->mbufs + i * MBUF_STRIDE);
+        m->slirp = slirp;
+        m->m_flags = M_FREELIST;
+        insque(m, &slirp->m_freelist);
+    }
+    slirp->mbuf_alloced += MBUF_SLAB_COUNT;
+    return 0;
+}
+
+/*
+ * Returns a cached external buffer of at least @size bytes, and its
+ * actual size in @bufsize, or NULL if there is none.
+ */
+static char *m_ext_get(Slirp *slirp, int size, int *bufsize)
+{
+    char *buf;
+    int i;
+
+    for (i = 0; i < slirp->m_ext_cached; i++) {
+        if (slirp->m_ext_cache[i].size >= size) {
+            buf = slirp->m_ext_cache[i].buf;
+            *bufsize = slirp->m_ext_cache[i].size;
+            slirp->m_ext_cache[i] = slirp->m_ext_cache[--slirp->m_ext_cached];
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void m_ext_put(Slirp *slirp, char *buf, int size)
+{
+    if (slirp->m_ext_cached < M_EXT_CACHE_SIZE) {
+        slirp->m_ext_cache[slirp->m_ext_cached].buf = buf;
+        slirp->m_ext_cache[slirp->m_ext_cached].size = size;
+        slirp->m_ext_cached++;
+    } else {
+        free(buf);
     }
 }
 
 /*
  * Get an mbuf from the free list, if there are none
- * malloc one
- *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * allocate a new slab of them
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
-	register struct mbuf *m;
-	int flags = 0;
+	register struct mbuf *m = NULL;
 
 	DEBUG_CALL("m_get");
 
-	if (slirp->m_freelist.m_next == &slirp->m_freelist) {
-		m = (struct mbuf *)malloc(SLIRP_MSIZE);
-		if (m == NULL) goto end_error;
-		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
-		m->slirp = slirp;
-	} else {
-		m = slirp->m_freelist.m_next;
-		remque(m);
+	if (slirp->m_freelist.m_next == &slirp->m_freelist &&
+	    m_alloc_slab(slirp) < 0) {
+		goto end_error;
 	}
+	m = slirp->m_freelist.m_next;
+	remque(m);
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -110,17 +170,12 @@ m_free(struct mbuf *m)
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
-	/* If it's M_EXT, free() it */
+	/* If it's M_EXT, keep the buffer for later or free() it */
 	if (m->m_flags & M_EXT)
-	   free(m->m_ext);
+	   m_ext_put(m->slirp, m->m_ext, m->m_size);
 
-	/*
-	 * Either free() it or put it on the free list
-	 */
-	if (m->m_flags & M_DOFREE) {
-		m->slirp->mbuf_alloced--;
-		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
+	/* Put it back on the free list */
+	if ((m->m_flags & M_FREELIST) == 0) {
 		insque(m,&m->slirp->m_freelist);
 		m->m_flags = M_FREELIST; /* Clobber other flags */
 	}
@@ -163,13 +218,20 @@ m_inc(struct mbuf *m, int size)
 	  m->m_data = m->m_ext + datasize;
         } else {
 	  char *dat;
+	  int bufsize;
+
 	  datasize = m->m_data - m->m_dat;
-	  dat = (char *)malloc(size);
+	  dat = m_ext_get(m->slirp, size, &bufsize);
+	  if (!dat) {
+	    dat = (char *)malloc(size);
+	    bufsize = size;
+	  }
 	  memcpy(dat, m->m_dat, m->m_size);
 
 	  m->m_ext = dat;
 	  m->m_data = m->m_ext + datasize;
 	  m->m_flags |= M_EXT;
+	  size = bufsize;
         }
 
         m->m_size = size;
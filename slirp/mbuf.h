@@ -97,8 +97,8 @@ struct mbuf {
 #define M_EXT			0x01	/* m_ext points to more (malloced) data */
 #define M_FREELIST		0x02	/* mbuf is on free list */
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
-#define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
-					 * it rather than putting it on the free list */
+
+#define M_EXT_CACHE_SIZE	8	/* external buffers kept for reuse */
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
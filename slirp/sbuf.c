@@ -60,6 +60,29 @@ sbreserve(struct sbuf *sb, int size)
 	}
 }
 
+/*
+ * Grow the buffer to size bytes, keeping its contents (unlike
+ * sbreserve).  The buffer never shrinks.
+ */
+void
+sbgrow(struct sbuf *sb, int size)
+{
+	char *data;
+
+	if (size <= sb->sb_datalen)
+		return;
+	data = (char *)malloc(size);
+	if (data == NULL)
+		return;
+	if (sb->sb_data) {
+		sbcopy(sb, 0, sb->sb_cc, data);
+		free(sb->sb_data);
+	}
+	sb->sb_data = sb->sb_rptr = data;
+	sb->sb_wptr = data + sb->sb_cc;
+	sb->sb_datalen = size;
+}
+
 /*
  * Try and write() to the socket, whatever doesn't get written
  * append to the buffer... for a host with a fast net connection,
@@ -773,8 +773,10 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
     struct ethhdr *eh = (struct ethhdr *)buf;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
+    char *start = (ifm->m_flags & M_EXT) ? ifm->m_ext : ifm->m_dat;
+    bool in_place = ifm->m_data - start >= ETH_HLEN;
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    if (!in_place && ifm->m_len + ETH_HLEN > sizeof(buf)) {
         return 1;
     }
 
@@ -816,13 +818,22 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        /*
+         * Output paths reserve IF_MAXLINKHDR bytes in front of the IP
+         * header, so the frame can usually be built in the mbuf itself.
+         */
+        if (in_place) {
+            eh = (struct ethhdr *)(ifm->m_data - ETH_HLEN);
+        }
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
-        slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        if (!in_place) {
+            memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
+        }
+        slirp_output(slirp->opaque, (uint8_t *)eh, ifm->m_len + ETH_HLEN);
         return 1;
     }
 }
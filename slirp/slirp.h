@@ -223,6 +223,12 @@ struct Slirp {
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    struct mbuf_slab *m_slabs;
+    struct {
+        char *buf;
+        int size;
+    } m_ext_cache[M_EXT_CACHE_SIZE];
+    int m_ext_cached;
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
@@ -142,16 +142,41 @@ size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
 	return iov[0].iov_len + (n - 1) * iov[1].iov_len;
 }
 
+/*
+ * Double the size of a socket buffer, up to TCP_SBUF_MAX.  Returns
+ * false if the buffer is already at its maximum size.
+ */
+static bool
+sogrow(struct sbuf *sb)
+{
+	int size = sb->sb_datalen;
+
+	if (size >= TCP_SBUF_MAX)
+		return false;
+	sbgrow(sb, min(size * 2, TCP_SBUF_MAX));
+	return sb->sb_datalen > size;
+}
+
+/* Maximum number of reads done by one call to soread() */
+#define SOREAD_MAX_PASSES 4
+
 /*
  * Read from so's socket into sb_snd, updating all relevant sbuf fields
  * NOTE: This will only be called if it is select()ed for reading, so
  * a read() of 0 (or less) means it's disconnected
+ *
+ * As long as the reads fill all of the buffer, keep reading (up to
+ * SOREAD_MAX_PASSES times).  The buffer grows if the guest's window is
+ * large enough to take all of it, so that bulk downloads aren't limited
+ * by the size of so_snd.
  */
 int
 soread(struct socket *so)
 {
-	int n, nn;
+	int n, nn, total, pass;
+	size_t space;
 	struct sbuf *sb = &so->so_snd;
+	struct tcpcb *tp = sototcpcb(so);
 	struct iovec iov[2];
 
 	DEBUG_CALL("soread");
@@ -161,7 +186,7 @@ soread(struct socket *so)
 	 * No need to check if there's enough room to read.
 	 * soread wouldn't have been called if there weren't
 	 */
-	sopreprbuf(so, iov, &n);
+	space = sopreprbuf(so, iov, &n);
 
 #ifdef HAVE_READV
 	nn = readv(so->s, (struct iovec *)iov, n);
@@ -205,7 +230,42 @@ soread(struct socket *so)
 	sb->sb_wptr += nn;
 	if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_wptr -= sb->sb_datalen;
-	return nn;
+
+	total = nn;
+	for (pass = 1; pass < SOREAD_MAX_PASSES && nn == (int)space; pass++) {
+		if (sbspace(sb) == 0 &&
+		    (tp->snd_wnd < sb->sb_datalen || !sogrow(sb)))
+			break;
+		space = sopreprbuf(so, iov, &n);
+		if (space == 0)
+			break;
+
+		/*
+		 * A close or an error is picked up by the next call,
+		 * the data read so far must be sent first.
+		 */
+#ifdef HAVE_READV
+		nn = readv(so->s, (struct iovec *)iov, n);
+#else
+		nn = qemu_recv(so->s, iov[0].iov_base, iov[0].iov_len, 0);
+		if (n == 2 && nn == iov[0].iov_len) {
+			int ret;
+			ret = qemu_recv(so->s, iov[1].iov_base, iov[1].iov_len, 0);
+			if (ret > 0)
+				nn += ret;
+		}
+#endif
+		DEBUG_MISC((dfd, " ... read nn = %d bytes (pass %d)\n", nn, pass));
+		if (nn <= 0)
+			break;
+
+		sb->sb_cc += nn;
+		sb->sb_wptr += nn;
+		if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
+			sb->sb_wptr -= sb->sb_datalen;
+		total += nn;
+	}
+	return total;
 }
 
 int soreadbuf(struct socket *so, const char *buf, int size)
@@ -348,6 +408,7 @@ sowrite(struct socket *so)
 	int  n,nn;
 	struct sbuf *sb = &so->so_rcv;
 	int len = sb->sb_cc;
+	bool full = len >= sb->sb_datalen / 4 * 3;
 	struct iovec iov[2];
 
 	DEBUG_CALL("sowrite");
@@ -421,6 +482,13 @@ sowrite(struct socket *so)
 	if (sb->sb_rptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_rptr -= sb->sb_datalen;
 
+	/*
+	 * If the guest filled most of the buffer and the host took all of
+	 * it, the advertised window is what limits the transfer: grow it.
+	 */
+	if (sb->sb_cc == 0 && full)
+		sogrow(sb);
+
 	/*
 	 * If in DRAIN mode, and there's no more data, set
 	 * it CANTSENDMORE
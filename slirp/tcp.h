@@ -38,8 +38,14 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/*
+ * Initial socket buffer sizes.  They grow up to TCP_SBUF_MAX while a bulk
+ * transfer is limited by them rather than by the guest or the host, see
+ * soread() and sowrite().
+ */
+#define TCP_SNDSPACE 65536
+#define TCP_RCVSPACE 65536
+#define TCP_SBUF_MAX (4 * 1024 * 1024)
 
 /*
  * TCP header.
@@ -97,6 +97,7 @@
 	} \
 }
 #endif
+static void tcp_setscale(struct tcpcb *tp);
 static void tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt,
                           struct tcpiphdr *ti);
 static void tcp_xmit_timer(register struct tcpcb *tp, int rtt);
@@ -402,7 +403,10 @@ findso:
 	if (tp->t_state == TCPS_CLOSED)
 		goto drop;
 
+	/* The window in SYN segments is never scaled */
 	tiwin = ti->ti_win;
+	if (!(tiflags & TH_SYN))
+		tiwin <<= tp->snd_scale;
 
 	/*
 	 * Segment received on connection.
@@ -550,6 +554,13 @@ findso:
 	  if ((tiflags & TH_SYN) == 0)
 	    goto drop;
 
+	  /*
+	   * Process the options of the SYN now: when the connect() to the
+	   * host is deferred, the segment is reprocessed without them.
+	   */
+	  if (optp)
+	    tcp_dooptions(tp, (u_char *)optp, optlen, ti);
+
 	  /*
 	   * This has way too many gotos...
 	   * But a bit of spaghetti code never hurt anybody :)
@@ -631,9 +642,6 @@ findso:
 	cont_input:
 	  tcp_template(tp);
 
-	  if (optp)
-	    tcp_dooptions(tp, (u_char *)optp, optlen, ti);
-
 	  if (iss)
 	    tp->iss = iss;
 	  else
@@ -688,6 +696,7 @@ findso:
 		if (tiflags & TH_ACK && SEQ_GT(tp->snd_una, tp->iss)) {
 			soisfconnected(so);
 			tp->t_state = TCPS_ESTABLISHED;
+			tcp_setscale(tp);
 
 			(void) tcp_reass(tp, (struct tcpiphdr *)0,
 				(struct mbuf *)0);
@@ -868,6 +877,7 @@ trimthenstep6:
 		    SEQ_GT(ti->ti_ack, tp->snd_max))
 			goto dropwithreset;
 		tp->t_state = TCPS_ESTABLISHED;
+		tcp_setscale(tp);
 		/*
 		 * The sent SYN is ack'ed with our sequence number +1
 		 * The first data byte already in the buffer will get
@@ -1323,6 +1333,15 @@ tcp_dooptions(struct tcpcb *tp, u_char *cp, int cnt, struct tcpiphdr *ti)
 			NTOHS(mss);
 			(void) tcp_mss(tp, mss);	/* sets t_maxseg */
 			break;
+
+		case TCPOPT_WINDOW:
+			if (optlen != TCPOLEN_WINDOW)
+				continue;
+			if (!(ti->ti_flags & TH_SYN))
+				continue;
+			tp->t_flags |= TF_RCVD_SCALE;
+			tp->requested_s_scale = min(cp[2], TCP_MAX_WINSHIFT);
+			break;
 		}
 	}
 }
@@ -1458,6 +1477,20 @@ tcp_xmit_timer(register struct tcpcb *tp, int rtt)
  * parameters from pre-set or cached values in the routing entry.
  */
 
+/*
+ * Use window scaling on the connection if both sides requested it
+ * in their SYN.
+ */
+static void
+tcp_setscale(struct tcpcb *tp)
+{
+	if ((tp->t_flags & (TF_RCVD_SCALE|TF_REQ_SCALE)) ==
+	    (TF_RCVD_SCALE|TF_REQ_SCALE)) {
+		tp->snd_scale = tp->requested_s_scale;
+		tp->rcv_scale = tp->request_r_scale;
+	}
+}
+
 int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
@@ -1477,12 +1510,13 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	/* Don't discard buffers that have already grown or hold data */
+	sbgrow(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
+                                            (mss - (TCP_SNDSPACE % mss)) :
+                                            0));
+	sbgrow(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
+                                            (mss - (TCP_RCVSPACE % mss)) :
+                                            0));
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
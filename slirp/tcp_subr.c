@@ -191,7 +191,14 @@ tcp_newtcpcb(struct socket *so)
 	tp->seg_next = tp->seg_prev = (struct tcpiphdr*)tp;
 	tp->t_maxseg = TCP_MSS;
 
-	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
+	/*
+	 * Window scaling is always requested, with a scale large enough
+	 * for the largest receive buffer.  Timestamps are not implemented.
+	 */
+	tp->t_flags = TF_REQ_SCALE | (TCP_DO_RFC1323 ? TF_REQ_TSTMP : 0);
+	while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+	       ((long)TCP_MAXWIN << tp->request_r_scale) < TCP_SBUF_MAX)
+		tp->request_r_scale++;
 	tp->t_socket = so;
 
 	/*
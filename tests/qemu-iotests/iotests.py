@@ -85,6 +85,7 @@ class VM(object):
                      '-qtest', 'stdio', '-machine', 'accel=qtest',
                      '-display', 'none', '-vga', 'none']
         self._num_drives = 0
+        self._iolog = None
 
     # This can be used to add an unused monitor instance.
     def add_monitor_telnet(self, ip, port):
@@ -108,7 +109,9 @@ class VM(object):
         return self
 
     def hmp_qemu_io(self, drive, cmd):
-        '''Write to a given drive using an HMP command'''
+        '''Write to a given drive using an HMP command
+
+        The output of qemu-io goes to the VM log, see get_log()'''
         return self.qmp('human-monitor-command',
                         command_line='qemu-io %s "%s"' % (drive, cmd))
 
@@ -157,10 +160,16 @@ class VM(object):
         if not self._popen is None:
             self._qmp.cmd('quit')
             self._popen.wait()
+            with open(self._qemu_log_path, 'r') as f:
+                self._iolog = f.read()
             os.remove(self._monitor_path)
             os.remove(self._qemu_log_path)
             self._popen = None
 
+    def get_log(self):
+        '''Return the output of the VM, available after shutdown()'''
+        return self._iolog
+
     underscore_to_dash = string.maketrans('_', '-')
     def qmp(self, cmd, **args):
         '''Invoke a QMP command and return the result dict'''
@@ -0,0 +1,80 @@
+/*
+ * Test network helper functions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/util.h"
+
+#define MTU 1500
+
+static uint8_t frame[14 + 4 + MTU + 1];
+
+/* Builds a frame with the given EtherType in @frame */
+static void make_frame(uint16_t proto)
+{
+    memset(frame, 0, sizeof(frame));
+    frame[12] = proto >> 8;
+    frame[13] = proto & 0xff;
+}
+
+static void test_max_frame_len_untagged(void)
+{
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+
+    make_frame(0x0800);
+    g_assert_cmpint(net_max_frame_len(&iov, 1, MTU), ==, 14 + MTU);
+    g_assert_cmpint(net_max_frame_len(&iov, 1, 9000), ==, 14 + 9000);
+}
+
+static void test_max_frame_len_vlan(void)
+{
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+
+    /* An 802.1Q tag comes on top of the MTU */
+    make_frame(0x8100);
+    g_assert_cmpint(net_max_frame_len(&iov, 1, MTU), ==, 14 + 4 + MTU);
+
+    /* Linux does not allow for 802.1ad tags */
+    make_frame(0x88a8);
+    g_assert_cmpint(net_max_frame_len(&iov, 1, MTU), ==, 14 + MTU);
+}
+
+static void test_max_frame_len_split(void)
+{
+    struct iovec iov[3];
+
+    /* The EtherType is split across two elements */
+    make_frame(0x8100);
+    iov[0].iov_base = frame;
+    iov[0].iov_len = 13;
+    iov[1].iov_base = frame + 13;
+    iov[1].iov_len = 1;
+    iov[2].iov_base = frame + 14;
+    iov[2].iov_len = sizeof(frame) - 14;
+    g_assert_cmpint(net_max_frame_len(iov, 3, MTU), ==, 14 + 4 + MTU);
+}
+
+static void test_max_frame_len_short(void)
+{
+    struct iovec iov = { .iov_base = frame, .iov_len = 13 };
+
+    /* Too short for an Ethernet header, cannot be tagged */
+    make_frame(0x8100);
+    g_assert_cmpint(net_max_frame_len(&iov, 1, MTU), ==, 14 + MTU);
+    g_assert_cmpint(net_max_frame_len(NULL, 0, MTU), ==, 14 + MTU);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/util/max-frame-len/untagged",
+                    test_max_frame_len_untagged);
+    g_test_add_func("/net/util/max-frame-len/vlan", test_max_frame_len_vlan);
+    g_test_add_func("/net/util/max-frame-len/split", test_max_frame_len_split);
+    g_test_add_func("/net/util/max-frame-len/short", test_max_frame_len_short);
+    return g_test_run();
+}
@@ -378,6 +378,32 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
     return iov_memset(qiov->iov, qiov->niov, offset, fillc, bytes);
 }
 
+/*
+ * Checks if all data in the vector is zero.  The bulk of each element is
+ * checked with the vectorized buffer_is_zero(), only unaligned tails are
+ * checked byte by byte.
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        const uint8_t *p = qiov->iov[i].iov_base;
+        size_t len = qiov->iov[i].iov_len;
+        size_t n = QEMU_ALIGN_DOWN(len, 4 * sizeof(long));
+
+        if (n && !buffer_is_zero(p, n)) {
+            return false;
+        }
+        for (; n < len; n++) {
+            if (p[n]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 size_t iov_discard_front(struct iovec **iov, unsigned int *iov_cnt,
                          size_t bytes)
 {